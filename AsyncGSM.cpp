@@ -1,868 +1,2679 @@
-/*
-  AsyncGSM.cpp
-*/
-
-#include "Arduino.h"
-#include "AsyncGSM.h"
-
-#define GSM_DEBUG_PRINT(...) debugStream->print(__VA_ARGS__)
-#define GSM_DEBUG_PRINTLN(...) debugStream->println(__VA_ARGS__)
-
-AsyncGSM::AsyncGSM(uint8_t reset, uint8_t pstat, uint8_t key)
-{
-  ok_reply = F("OK");
-  pinMode(reset, OUTPUT);
-  pinMode(pstat, INPUT);
-  pinMode(key, OUTPUT);
-  digitalWrite(key, HIGH);
-  this->power_state = digitalRead(pstat);
-  this->reset = reset;
-  this->pstat = pstat;
-  this->key = key;
-  modem_state = STATE_IDLE;
-  autobauding = 0;
-  echo = 0;
-  cnmi = 0;
-  command_state = COMMAND_NONE;
-  currentconnection = -1;
-  command_timeout = 10000;
-}
-
-void AsyncGSM::setPower(uint8_t power) {
-  this->power = power;
-  uint8_t current_power = digitalRead(pstat);
-  //GSM_DEBUG_PRINTLN(F("setPower: "));
-  //GSM_DEBUG_PRINTLN(power);
-  //GSM_DEBUG_PRINTLN(current_power);
-}
-
-uint8_t AsyncGSM::handlePowerState() {
-  uint8_t current_power = digitalRead(pstat);
-  if (!current_power && power && power_state == POWER_STATE_OFF) {
-    // start turning on
-    GSM_DEBUG_PRINT(F("Turning on. Current power: "));
-    GSM_DEBUG_PRINTLN(current_power);
-    power_state = POWER_STATE_STARTING;
-    digitalWrite(key, LOW);
-    power_state_changed = millis();
-    return 0;
-  } else if (current_power && !power && power_state == POWER_STATE_ON) {
-    // start turning off
-    GSM_DEBUG_PRINT(F("Turning off. Current power: "));
-    GSM_DEBUG_PRINTLN(current_power);
-    power_state = POWER_STATE_STOPPING;
-    digitalWrite(key, LOW);
-    power_state_changed = millis();
-    return 0;
-  } else if ((power_state == POWER_STATE_STOPPING || power_state == POWER_STATE_STARTING) && millis() > (power_state_changed + 3000)) {
-    // stop "pressing" key and reset power_state
-    GSM_DEBUG_PRINTLN(F("Release key button"));
-    digitalWrite(key, HIGH);
-    power_state = digitalRead(pstat);
-    GSM_DEBUG_PRINT(F("current_power: "));
-    GSM_DEBUG_PRINTLN(power_state);
-    resetModemState();
-    return power_state;
-  }
-
-  return current_power;
-}
-
-void AsyncGSM::resetModemState() {
-  echo = 0;
-  cscs = 0;
-  clip = 0;
-  cmgf = 0;
-  cnmi = 0;
-  cipmux = 0;
-  creg = 0;
-  modem_state = STATE_IDLE;
-  autobauding = 0;
-  command_state = COMMAND_NONE;
-  gprs_state = GPRS_STATE_UNKNOWN;
-  currentconnection = -1;
-  command_timeout = 10000;
-}
-
-uint8_t AsyncGSM::initialize(Stream &serial)
-{
-  mySerial = &serial;
-}
-
-void AsyncGSM::setDebugStream(Stream &stream)
-{
-  debugStream = &stream;
-}
-
-uint8_t AsyncGSM::writeBuffer(CircularBuffer * buffer, char data) {
-  int next = buffer->head + 1;
-  if (next >= NELEMS(buffer->buffer))
-    next = 0;
-
-  // Cicular buffer is full
-  if (next == buffer->tail)
-    return -1;  // quit with an error
-
-  buffer->buffer[buffer->head] = data;
-  buffer->head = next;
-  return 0;
-}
-
-uint8_t AsyncGSM::readBuffer(CircularBuffer * buffer, char * data) {
-  // if the head isn't ahead of the tail, we don't have any characters
-  if (buffer->head == buffer->tail)
-    return -1;  // quit with an error
-
-  *data = buffer->buffer[buffer->tail];
-  buffer->buffer[buffer->tail] = 0;  // clear the data (optional)
-
-  int next = buffer->tail + 1;
-  if(next >= NELEMS(buffer->buffer))
-    next = 0;
-
-  buffer->tail = next;
-
-  return 0;
-}
-
-uint8_t AsyncGSM::bufferSize(CircularBuffer * buffer) {
-  if (buffer->head > buffer->tail) {
-    return buffer->head - buffer->tail;
-  }
-  if (buffer->head < buffer->tail) {
-    return GSM_BUFFER_SIZE - buffer->tail + buffer->head;
-  }
-  return 0;
-}
-
-
-
-uint8_t AsyncGSM::dataAvailable(int connection) {
-  return bufferSize(&connectionState[connection].inboundCircular);
-}
-
-uint8_t AsyncGSM::outboundBufferSize(int connection) {
-  return bufferSize(&connectionState[connection].outboundCircular);
-}
-
-uint8_t AsyncGSM::messageAvailable() {
-  return messageBuffer.available;
-}
-
-ShortMessage AsyncGSM::readMessage() {
-  ShortMessage messageCopy = messageBuffer;
-  messageBuffer.available = 0;
-  return messageCopy;
-}
-
-void AsyncGSM::sendMessage(ShortMessage message) {
-  outboundMessage = message;
-}
-
-int8_t AsyncGSM::incomingCall() {
-  return incomingcall;
-}
-
-char * AsyncGSM::getCallerIdentification() {
-  return callerId;
-}
-
-void AsyncGSM::answerIncomingCall() {
-  if (incomingcall && !answerincomingcall && !callinprogress) {
-    answerincomingcall = 1;
-  }
-}
-
-void AsyncGSM::hangupCall() {
-
-}
-
-// state machine
-void AsyncGSM::process() {
-
-  uint8_t current_power = handlePowerState();
-  if (!current_power) {
-    return;
-  }
-
-  
-  if(mySerial->available() > 0) {
-    processIncomingModemByte(mySerial->read());
-  }
-
-  // check for timeout
-  if (modem_state == STATE_WAITING_REPLY && millis() > last_command + command_timeout) {
-    GSM_DEBUG_PRINTLN(F("TIMEOUT"));
-    modem_state = STATE_IDLE;
-  }
-  
-  if (modem_state == STATE_IDLE && !autobauding) {
-    queueAtCommand(F("AT"), 2000);
-    return;
-  }
-  
-  if (modem_state == STATE_IDLE && !echo && autobauding) {
-    queueAtCommand(F("ATE0"), 5000);
-    command_state = COMMAND_ATE;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && incomingcall && answerincomingcall) {
-    queueAtCommand(F("ATA"), 5000);
-    command_state = COMMAND_ATA;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && (millis() > last_csq_update + 90000) && autobauding) {
-    queueAtCommand(F("AT+CSQ"), 5000);
-    last_csq_update = millis();
-    command_state = COMMAND_CSQ;
-    return;
-  }
-  
-  if (modem_state == STATE_IDLE && (millis() > last_battery_update + 60000) && autobauding) {
-    queueAtCommand(F("AT+CBC"), 5000);
-    last_battery_update = millis();
-    command_state = COMMAND_CBC;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && (millis() > last_creg + 60000) && autobauding && creg < 2) {
-    queueAtCommand(F("AT+CREG?"), 5000);
-    last_creg = millis();
-    command_state = COMMAND_TEST_CREG;
-    return;
-  } else if (creg < 2) {
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && autobauding && !powersave && enable_powersave) {
-    queueAtCommand(F("AT+CSCLK=1"), 5000);
-    command_state = COMMAND_ENABLE_POWERSAVE;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && autobauding && powersave && !enable_powersave) {
-    queueAtCommand(F("AT+CSCLK=0"), 5000);
-    command_state = COMMAND_DISABLE_POWERSAVE;
-    return;
-  }  
-  
-  if (modem_state == STATE_IDLE && !clts && autobauding) {
-    queueAtCommand(F("AT+CLTS=1"), 5000);
-    command_state = COMMAND_SET_CLTS;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && !clip && autobauding) {
-    queueAtCommand(F("AT+CLIP=1"), 5000);
-    command_state = COMMAND_WRITE_CLIP;
-    return;
-  }
-  
-  if (modem_state == STATE_IDLE && cipmux == 1 && autobauding && creg == 2) {
-    queueAtCommand(F("AT+CIPMUX=1"), 5000);
-    command_state = COMMAND_WRITE_CIPMUX;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && !cipmux && autobauding && creg == 2) {
-    queueAtCommand(F("AT+CIPMUX?"), 5000);
-    command_state = COMMAND_TEST_CIPMUX;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && gprs_state == GPRS_STATE_UNKNOWN && autobauding && creg == 2 && enable_gprs) {
-    queueAtCommand(F("AT+CIPSHUT"), 10000);
-    command_state = COMMAND_CIPSHUT;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && (gprs_state != GPRS_STATE_IP_INITIAL) && autobauding && creg == 2 && !enable_gprs) {
-    queueAtCommand(F("AT+CIPSHUT"), 10000);
-    command_state = COMMAND_CIPSHUT;
-    return;
-  }
-  
-  if (modem_state == STATE_IDLE && gprs_state == GPRS_STATE_IP_INITIAL && autobauding && creg == 2 && enable_gprs) {
-    queueAtCommand(F("AT+CSTT=\"internet.saunalahti\",\"\",\"\""), 10000);
-    command_state = COMMAND_SET_CSTT;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && !cnmi && autobauding) {
-    queueAtCommand(F("AT+CNMI?"), 10000);
-    command_state = COMMAND_TEST_CNMI;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && !cmgf && autobauding) {
-    queueAtCommand(F("AT+CMGF?"), 10000);
-    command_state = COMMAND_TEST_CMGF;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && cmgf == 1 && autobauding) {
-    // text mode sms
-    queueAtCommand(F("AT+CMGF=1"), 5000);
-    command_state = COMMAND_WRITE_CMGF;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && !cscs && autobauding) {
-    // text mode sms
-    queueAtCommand(F("AT+CSCS=\"8859-1\""), 5000);
-    command_state = COMMAND_WRITE_CSCS;
-    return;
-  }
-  
-  if (modem_state == STATE_IDLE && cnmi == 1 && autobauding) {
-    queueAtCommand(F("AT+CNMI=2,2,0,0,0"), 60000);
-    command_state = COMMAND_WRITE_CNMI;
-    return;
-  }
-
-
-  if (modem_state == STATE_IDLE && (millis() > last_time_update + 120000) && autobauding) {
-    queueAtCommand(F("AT+CCLK?"), 5000);
-    last_time_update = millis();
-    command_state = COMMAND_TEST_CCLK;
-    return;
-  }
-
-
-
-
-  
-  if (modem_state == STATE_IDLE && gprs_state == GPRS_STATE_IP_START && autobauding && creg == 2 && enable_gprs) {
-    queueAtCommand(F("AT+CIICR"), 120000);
-    command_state = COMMAND_SET_CIICR;
-    return;
-  }
-
-  if (modem_state == STATE_IDLE && gprs_state == GPRS_STATE_IP_GPRSACT && autobauding && creg == 2 && enable_gprs) {
-    queueAtCommand(F("AT+CIFSR"), 120000);
-    command_state = COMMAND_CIFSR;
-    return;
-  }
-
-  for (int i = 0; i < NELEMS(connectionState); i++) {
-    if (modem_state == STATE_IDLE && 
-	gprs_state == GPRS_STATE_IP_STATUS && 
-	connectionState[i].connectionState != GPRS_STATE_CONNECT_OK && 
-	creg == 2 &&
-	strlen(connectionState[i].address) > 0 &&
-	connectionState[i].port != 0 &&
-	connectionState[i].connect &&
-	enable_gprs) {
-      char command[32];
-      sprintf(command, "AT+CIPSTART=%u,\"%s\",\"%s\",%u",
-	      i,
-	      connectionState[i].type == CONNECTION_TYPE_TCP ? "TCP" : "UDP",
-	      connectionState[i].address,
-	      connectionState[i].port); 
-      queueAtCommand(command, 60000);
-      command_state = COMMAND_WRITE_CIPSTART;
-      currentconnection = i;
-      return;
-    }
-  }
-
-
-  for (int j = 0; j < NELEMS(connectionState); j++) {
-    if (modem_state == STATE_IDLE && 
-	gprs_state == GPRS_STATE_IP_STATUS && 
-	connectionState[j].connectionState == GPRS_STATE_CONNECT_OK && 
-	bufferSize(&connectionState[j].outboundCircular) > 0 && creg == 2 && enable_gprs) {
-      char command[16];
-      connectionState[j].outboundBytes = bufferSize(&connectionState[j].outboundCircular);
-      sprintf(command, "AT+CIPSEND=%u,%u", j, connectionState[j].outboundBytes);
-      queueAtCommand(command, 120000);
-      command_state = COMMAND_WRITE_CIPSEND;
-      currentconnection = j;
-      return;
-    }
-  }
-
-  for (int i = 0; i < NELEMS(connectionState); i++) {
-    if (modem_state == STATE_IDLE && 
-	gprs_state == GPRS_STATE_IP_STATUS && 
-	connectionState[i].connectionState == GPRS_STATE_CONNECT_OK && 
-	creg == 2 &&
-	!connectionState[i].connect && enable_gprs) {
-      char command[32];
-      sprintf(command, "AT+CIPCLOSE=%u,0", i);
-      queueAtCommand(command, 60000);
-      command_state = COMMAND_WRITE_CIPCLOSE;
-      currentconnection = i;
-      return;
-    }
-  }
-
-  
-  /*
-  if (millis() > last_udp_send + 120000) {
-    char data[16];
-    sprintf(data, "Test%u", millis());
-    writeData(data, strlen(data));
-    last_udp_send = millis();  
-  }
-  */
-
-  if (modem_state == STATE_IDLE && strlen(outboundMessage.message) > 0 && autobauding && creg == 2) {
-    char command[64];
-    sprintf(command, "AT+CMGS=\"%s\"", outboundMessage.msisdn);
-    queueAtCommand(command, 10000);
-    command_state = COMMAND_WRITE_CMGS;
-  }
-
-  
-  
-}
-
-
-uint8_t AsyncGSM::isConnected(int connection) {
-  return connectionState[connection].connectionState == GPRS_STATE_CONNECT_OK;
-}
-
-uint8_t AsyncGSM::isModemIdle() {
-  return modem_state == STATE_IDLE;
-}
-
-uint8_t AsyncGSM::isModemError() {
-  return modem_state == STATE_ERROR;
-}
-
-uint8_t AsyncGSM::isModemRegistered() {
-  return creg == 2;
-}
-
-void AsyncGSM::enableGprs() {
-  enable_gprs = 1;
-}
-
-void AsyncGSM::disableGprs() {
-  enable_gprs = 0;
-}
-
-void AsyncGSM::enablePowerSave() {
-  enable_powersave = 1;
-}
-
-void AsyncGSM::disablePowerSave() {
-  enable_powersave = 0;
-}
-
-uint8_t AsyncGSM::isGprsEnabled() {
-  return gprs_state == GPRS_STATE_IP_STATUS; 
-}
-
-uint8_t AsyncGSM::isGprsDisabled() {
-  return gprs_state == GPRS_STATE_UNKNOWN || gprs_state == GPRS_STATE_IP_INITIAL;
-}
-
-void AsyncGSM::connect(char * data, int port, int connection, int type) {
-  memcpy(connectionState[connection].address, data, strlen(data) + 1);
-  connectionState[connection].port = port;
-  connectionState[connection].type = type;
-  connectionState[connection].connect = 1;
-}
-
-void AsyncGSM::disconnect(int connection) {
-  connectionState[connection].address[0] = NULL;
-  connectionState[connection].port = 0;
-  connectionState[connection].connect = 0;
-}
-
-uint8_t AsyncGSM::writeData(char * data, int len, int connection) {
-  for (int i = 0; i < len; i++) {
-    writeBuffer(&connectionState[connection].outboundCircular, data[i]);
-  }
-}
-
-void AsyncGSM::queueAtCommand(char * command, uint32_t timeout) {
-  GSM_DEBUG_PRINT(F("--> ")); GSM_DEBUG_PRINTLN(command);
-  mySerial->println(command);
-  last_command = millis();
-  command_timeout = timeout;
-  modem_state = STATE_WAITING_REPLY;
-  GSM_DEBUG_PRINTLN(F("STATE_WAITING_REPLY"));
-}
-
-void AsyncGSM::queueAtCommand(GSMFlashStringPtr command, uint32_t timeout) {
-  GSM_DEBUG_PRINT(F("--> ")); GSM_DEBUG_PRINTLN(command);
-  mySerial->println(command);
-  last_command = millis();
-  command_timeout = timeout;
-  modem_state = STATE_WAITING_REPLY;
-  GSM_DEBUG_PRINTLN(F("STATE_WAITING_REPLY"));
-}
-
-time_t AsyncGSM::getCurrentTime() {
-  return last_network_time + (millis() - last_network_time_update) / 1000;
-}
-
-uint8_t AsyncGSM::parseConnectionNumber(char * data) {
-  data[1] = 0;
-  return atoi(data);
-}
-
-void AsyncGSM::processIncomingModemByte (const byte inByte) {
-
-  switch (inByte) {
-
-  case '\n':   // end of text
-    input_modem_line[input_modem_pos] = 0;  // terminating null byte
-
-    // terminator reached! process input_line here ...
-    process_modem_data (input_modem_line);
-
-    // reset buffer for next time
-    input_modem_pos = 0;
-    break;
-
-  case '\r':   // discard carriage return
-    break;
-
-  case '>':
-    input_modem_line[input_modem_pos++] = inByte;
-    input_modem_line[input_modem_pos++] = 0;
-    process_modem_data(input_modem_line);
-    input_modem_pos = 0;
-    break;
-
-  default:
-    // keep adding if not full ... allow for terminating null byte
-    if (input_modem_pos < (MAX_INPUT - 1))
-      input_modem_line [input_modem_pos++] = inByte;
-    break;
-
-  }
-}
-
-#define LEAP_YEAR(Y)     ( ((1970+Y)>0) && !((1970+Y)%4) && ( ((1970+Y)%100) || !((1970+Y)%400) ) )
-
-static  const uint8_t monthDays[]={31,28,31,30,31,30,31,31,30,31,30,31}; // API starts months from 1, this array starts from 0
-
-time_t AsyncGSM::parseTime(char * data) {
-  char year[3];
-  char month[3];
-  char day[3];
-  char hour[3];
-  char minute[3];
-  char secs[3];
-  memcpy(year, data, 2);
-  year[2] = 0;
-  memcpy(month, data + 3, 2);
-  month[2] = 0;
-  memcpy(day, data + 6, 2);
-  day[2] = 0;
-  memcpy(hour, data + 9, 2);
-  hour[2] = 0;
-  memcpy(minute, data + 12, 2);
-  minute[2] = 0;
-  memcpy(secs, data + 15, 2);
-  secs[2] = 0;
-  tmelements_t tm;
-  tm.second = atoi(secs);
-  tm.minute = atoi(minute);
-  tm.hour = atoi(hour);
-  tm.day = atoi(day);
-  tm.month = atoi(month);
-  tm.year = atoi(year) + 2000 - 1970;
-
-  int i;
-  uint32_t seconds;
-
-  // seconds from 1970 till 1 jan 00:00:00 of the given year
-  seconds= tm.year*(SECS_PER_DAY * 365);
-  for (i = 0; i < tm.year; i++) {
-    if (LEAP_YEAR(i)) {
-      seconds +=  SECS_PER_DAY;   // add extra days for leap years
-    }
-  }
-
-  // add days for this year, months start from 1
-  for (i = 1; i < tm.month; i++) {
-    if ( (i == 2) && LEAP_YEAR(tm.year)) {
-      seconds += SECS_PER_DAY * 29;
-    } else {
-      seconds += SECS_PER_DAY * monthDays[i-1];  //monthDay array starts from 0
-    }
-  }
-  seconds+= (tm.day-1) * SECS_PER_DAY;
-  seconds+= tm.hour * SECS_PER_HOUR;
-  seconds+= tm.minute * SECS_PER_MIN;
-  seconds+= tm.second;
-  return (time_t)seconds; 
-}
-
-void AsyncGSM::process_modem_data (char * data) {
-  GSM_DEBUG_PRINT(F("<-- "));
-  GSM_DEBUG_PRINTLN(data);
-
-  if (strstr(data, "+CMT:") != 0) {
-    command_state = COMMAND_UCR_CMT;
-    modem_state = STATE_UCR;
-  }
-
-  if (command_state == COMMAND_UCR_CMT) {
-    int index = 0;
-    char * pch;
-    pch = strtok (data, "\"");
-    while (pch != NULL) {
-      if (index == 1) {
-	memcpy(messageBuffer.msisdn, pch, strlen(pch) + 1);
-      } else if (index == 4) {
-	messageBuffer.receive_time = parseTime(pch);
-      }
-      
-      pch = strtok (NULL, "\"");
-      index++;
-    }
-    command_state = COMMAND_UCR_CMT_DATA;
-    return;
-  }
-
-  if (command_state == COMMAND_TEST_CCLK) {
-    
-    if (strstr(data, "+CCLK:") != 0) {
-      last_network_time = parseTime(data + 8);
-      last_network_time_update = millis();
-      GSM_DEBUG_PRINT("current_time: ");
-      GSM_DEBUG_PRINTLN(last_network_time);
-    }
-  }
-  
-  if (command_state == COMMAND_UCR_CMT_DATA) {
-    memcpy(messageBuffer.message, data, strlen(data) + 1);
-    messageBuffer.available = 1;
-    modem_state = STATE_IDLE;
-    GSM_DEBUG_PRINTLN(messageBuffer.msisdn);
-    GSM_DEBUG_PRINTLN(messageBuffer.receive_time);
-    GSM_DEBUG_PRINTLN(messageBuffer.message);
-    GSM_DEBUG_PRINTLN("STATE_IDLE");
-  }
-
-  if (command_state == COMMAND_WRITE_CMGS) {
-    if (strstr(data, "OK") != 0) {
-      modem_state = STATE_IDLE;
-      GSM_DEBUG_PRINTLN("STATE_IDLE");
-    }
-
-    if (strstr(data, ">") != 0) {
-      GSM_DEBUG_PRINTLN(strlen(outboundMessage.message));
-      GSM_DEBUG_PRINT(F("--> ")); 
-      GSM_DEBUG_PRINTLN(outboundMessage.message);
-      mySerial->write(outboundMessage.message, strlen(outboundMessage.message));
-      mySerial->write("\x1A");
-      mySerial->flush();
-      outboundMessage.message[0] = 0;
-      outboundMessage.msisdn[0] = 0;
-    }
-    
-  }
-
-  if (command_state == COMMAND_TEST_CREG) {
-    if (strstr(data, "+CREG: 0,1") != 0) {
-      creg = 2;
-      return;
-    } else if (strstr(data, "+CREG: 0,2") != 0) {
-      creg = 1;
-      return;
-    }
-  }
-  
-  if (command_state == COMMAND_WRITE_CIPSEND) {
-    if (strstr(data, ">") != 0) {
-      // write data
-      int len = connectionState[currentconnection].outboundBytes;
-      char data[len];
-      for (int i = 0; i < len; i++) {
-	readBuffer(&connectionState[currentconnection].outboundCircular, data + i);
-      }
-      GSM_DEBUG_PRINT(F("Writing to gsm serial"));
-      GSM_DEBUG_PRINTLN(connectionState[currentconnection].outboundBytes);
-      mySerial->write(data, len);
-      mySerial->flush();
-      GSM_DEBUG_PRINTLN(F("Write ok."));
-      return;
-    }
-
-    if (strstr(data, "SEND OK") != 0) {
-      modem_state = STATE_IDLE;
-      currentconnection = -1;
-      GSM_DEBUG_PRINTLN(F("STATE_IDLE"));
-      return;
-    }
-  }
-  
-  if (command_state == COMMAND_WRITE_CIPSTART) {
-    GSM_DEBUG_PRINTLN("COMMAND_WRITE_CIPSTART2");
-    
-    if (strstr(data, "CONNECT OK") != 0) {
-      connectionState[currentconnection].connectionState = GPRS_STATE_CONNECT_OK;
-      modem_state = STATE_IDLE;
-      currentconnection = -1;
-      GSM_DEBUG_PRINTLN(F("STATE_IDLE"));
-      return;
-    } else if (strstr(data, "CONNECT FAIL") != 0) {
-      // tcp or udp connection failed
-      uint8_t connectionNumber = parseConnectionNumber(data);
-      GSM_DEBUG_PRINTLN(connectionNumber);
-      connectionState[0].connectionState = GPRS_STATE_IP_INITIAL;
-      modem_state = STATE_IDLE;
-      GSM_DEBUG_PRINTLN(F("STATE_IDLE"));
-    }
-
-    if (strstr(data, "OK") != 0) {
-      return;
-    }
-
-  }
-
-  if (command_state == COMMAND_WRITE_CIPCLOSE) {
-    if (strstr(data, "CLOSE OK") != 0) {
-      // tcp or udp connection closed
-      uint8_t connectionNumber = parseConnectionNumber(data);
-      connectionState[connectionNumber].connectionState = GPRS_STATE_IP_INITIAL;
-      modem_state = STATE_IDLE;
-      GSM_DEBUG_PRINTLN(F("STATE_IDLE"));
-    }
-  }
-  
-  if (command_state == COMMAND_TEST_CNMI && strstr(data, "+CNMI:") != 0) {
-    if (strstr(data, "+CNMI:2,2,0,0,0") == 0) {
-      cnmi = 1;
-    }
-  }
-
-  if (command_state == COMMAND_TEST_CMGF) {
-    if (strstr(data, "+CMGF: 1") != 0) {
-      cmgf = 2;
-    } else if (strstr(data, "+CMGF: 0") != 0) {
-      cmgf = 1;
-    }
-  }
-
-  if (command_state == COMMAND_CIPSHUT && strstr(data, "SHUT OK") != 0) {
-    gprs_state = GPRS_STATE_IP_INITIAL;
-    modem_state = STATE_IDLE;
-    GSM_DEBUG_PRINTLN(F("STATE_IDLE"));
-  }
-
-  if (command_state == COMMAND_CIFSR && strlen(data) > 0) {
-    gprs_state = GPRS_STATE_IP_STATUS;
-    modem_state = STATE_IDLE;
-    GSM_DEBUG_PRINTLN(F("STATE_IDLE"));
-  }
-  
-  if (command_state == COMMAND_TEST_CIPMUX && strstr(data, "+CIPMUX:") != 0) {
-    if (strstr(data, "+CIPMUX: 1") != 0) {
-      cipmux = 2;
-    } else if (strstr(data, "+CIPMUX: 0") != 0) {
-      cipmux = 1;
-    }
-  }
-  
-  if (strcmp(data, "OK") == 0) {
-    if (!autobauding) {
-      autobauding = 1;
-    }
-
-    if (command_state == COMMAND_ENABLE_POWERSAVE) {
-      powersave = 1;
-    }
-
-    if (command_state == COMMAND_DISABLE_POWERSAVE) {
-      powersave = 0;
-    }
-    
-    if (command_state == COMMAND_ATA) {
-      callinprogress = 1;
-      answerincomingcall = 0;
-    }
-    
-    if (command_state == COMMAND_ATE) {
-      echo = 1;
-    }
-
-    if (command_state == COMMAND_WRITE_CIPMUX) {
-      cipmux = 2;
-    }
-
-    if (command_state == COMMAND_SET_CSTT) {
-      gprs_state = GPRS_STATE_IP_START;
-    }
-
-    if (command_state == COMMAND_WRITE_CNMI) {
-      cnmi = 2;
-    }
-
-    if (command_state == COMMAND_SET_CIICR) {
-      gprs_state = GPRS_STATE_IP_GPRSACT;
-    }
-
-    if (command_state == COMMAND_SET_CLTS) {
-      clts = 1;
-    }
-
-    if (command_state == COMMAND_WRITE_CMGF) {
-      cmgf = 2;
-    }
-
-    if (command_state == COMMAND_WRITE_CSCS) {
-      cscs = 1;
-    }
-
-    if (command_state == COMMAND_WRITE_CLIP) {
-      clip = 1;
-    }
-    
-    modem_state = STATE_IDLE;
-    GSM_DEBUG_PRINTLN(F("STATE_IDLE"));
-  }
-
-  if (strstr(data, "RING") != 0) {
-    incomingcall = 1;
-  }
-
-  if (strstr(data, "NO CARRIER") != 0) {
-    incomingcall = 0;
-    callinprogress = 0;
-    answerincomingcall = 0;
-  }
-
-  if (strstr(data, "SMS Ready") != 0) {
-    GSM_DEBUG_PRINTLN(F("resetModemState()"));
-    resetModemState();
-  }
-  
-  if (strstr(data, "ERROR") != 0) {
-    modem_state = STATE_ERROR;
-    GSM_DEBUG_PRINTLN(F("STATE_ERROR"));
-
-    // reset modem
-
-  }
-
-  if (strstr(data, "CLOSED") != 0) {
-    // tcp or udp connection closed
-    uint8_t connectionNumber = parseConnectionNumber(data);
-    connectionState[0].connectionState = GPRS_STATE_IP_INITIAL;
-  }
-
-  if (strstr(data, "+RECEIVE") != 0) {
-    data[strlen(data) - 1] = NULL;
-    data[10] = NULL;
-    uint8_t connectionNumber = atoi(data + 9);
-    uint16_t availableData = atoi(data + 11);
-    GSM_DEBUG_PRINTLN(connectionNumber);
-    GSM_DEBUG_PRINTLN(availableData);
-    command_state = COMMAND_UCR_RECEIVE;
-    GSM_DEBUG_PRINTLN(F("COMMAND_UCR_RECEIVE"));
-    return;
-  }
-
-  
-}
+/*
+  AsyncGSM.cpp
+*/
+
+#include "Arduino.h"
+#include "AsyncGSM.h"
+
+// Log levels above GSM_LOG_LEVEL compile to nothing
+#define GSM_LOG_PRINT(...) do { if (debugStream) debugStream->print(__VA_ARGS__); } while (0)
+#define GSM_LOG_PRINTLN(...) do { if (debugStream) debugStream->println(__VA_ARGS__); } while (0)
+
+#if GSM_LOG_LEVEL >= GSM_LOG_ERROR
+#define GSM_ERROR_PRINT(...) GSM_LOG_PRINT(__VA_ARGS__)
+#define GSM_ERROR_PRINTLN(...) GSM_LOG_PRINTLN(__VA_ARGS__)
+#else
+#define GSM_ERROR_PRINT(...)
+#define GSM_ERROR_PRINTLN(...)
+#endif
+
+#if GSM_LOG_LEVEL >= GSM_LOG_INFO
+#define GSM_INFO_PRINT(...) GSM_LOG_PRINT(__VA_ARGS__)
+#define GSM_INFO_PRINTLN(...) GSM_LOG_PRINTLN(__VA_ARGS__)
+#else
+#define GSM_INFO_PRINT(...)
+#define GSM_INFO_PRINTLN(...)
+#endif
+
+#if GSM_LOG_LEVEL >= GSM_LOG_TRACE
+#define GSM_TRACE_PRINT(...) GSM_LOG_PRINT(__VA_ARGS__)
+#define GSM_TRACE_PRINTLN(...) GSM_LOG_PRINTLN(__VA_ARGS__)
+#else
+#define GSM_TRACE_PRINT(...)
+#define GSM_TRACE_PRINTLN(...)
+#endif
+
+#if GSM_TRACE_BUFFER_SIZE > 0
+#define GSM_TRACE_EVENT(event, arg) recordTrace((event), (arg))
+#else
+#define GSM_TRACE_EVENT(event, arg)
+#endif
+
+#if GSM_ENABLE_STATS
+#define GSM_STATS(statement) do { statement; } while (0)
+#else
+#define GSM_STATS(statement)
+#endif
+
+AsyncGSM::AsyncGSM(uint8_t reset, uint8_t pstat, uint8_t key)
+{
+  ok_reply = F("OK");
+  pinMode(reset, OUTPUT);
+  pinMode(pstat, INPUT);
+  pinMode(key, OUTPUT);
+  digitalWrite(key, HIGH);
+  this->power_state = digitalRead(pstat);
+  this->reset = reset;
+  this->pstat = pstat;
+  this->key = key;
+  power = 0;
+  mySerial = NULL;
+  memset(connectionState, 0, sizeof(connectionState));
+  modem_state = STATE_IDLE;
+  autobauding = 0;
+  echo = 0;
+  command_state = COMMAND_NONE;
+  currentconnection = -1;
+  next_send_connection = 0;
+  debugStream = NULL;
+#if GSM_TRACE_BUFFER_SIZE > 0
+  memset(traceBuffer, 0, sizeof(traceBuffer));
+  traceHead = 0;
+  traceCount = 0;
+#endif
+  rx_budget = GSM_RX_BUDGET;
+  qsend_budget = GSM_QSEND_BUDGET;
+  receive_remaining = 0;
+  receive_connection = -1;
+  cipmux = 0;
+  cipqsend = 0;
+  gprs_state = GPRS_STATE_UNKNOWN;
+  gprs_active = 0;
+  ip_address = 0;
+  creg = 0;
+  creg_urc = 0;
+  last_udp_send = 0;
+  last_command = 0;
+  enable_ifc = 0;
+  ifc = 0;
+  rts_pin = -1;
+  cts_pin = -1;
+  receive_hold = 0;
+  enable_cipmode = 0;
+  cipmode = 0;
+  data_mode = DATA_MODE_OFF;
+  command_hold = 0;
+  result_match = 0;
+  escape_attempts = 0;
+  command_steps = gsmDefaultCommandSteps;
+  command_step_count = gsmDefaultCommandStepCount;
+  memset(commandQueue, 0, sizeof(commandQueue));
+  commandQueueLength = 0;
+  command_callback = NULL;
+  command_context = NULL;
+  command_expected = MODEM_LINE_OK;
+  command_reply = NULL;
+  event_callback = NULL;
+  event_context = NULL;
+  baud_callback = NULL;
+  baud_context = NULL;
+  baud_target = 0;
+  baud_fallback = 0;
+  baud_state = BAUD_STATE_OFF;
+  baud_current = 0;
+  baud_failures = 0;
+  enable_cipqsend = 0;
+  enable_gprs = 0;
+  enable_powersave = 0;
+  powersave = 0;
+  polling_suspended = 0;
+#if GSM_ENABLE_SMS
+  cnmi = 0;
+  cmgf = 0;
+  cscs = 0;
+  cmms = 0;
+  sms_body_pending = 0;
+  memset(inboundMessages, 0, sizeof(inboundMessages));
+  inbound_message_head = 0;
+  inbound_message_count = 0;
+  inbound_message_overflow = 0;
+  memset(outboundMessages, 0, sizeof(outboundMessages));
+  outbound_message_head = 0;
+  outbound_message_count = 0;
+  outbound_message_reference = 0;
+#endif
+#if GSM_ENABLE_CALLS
+  clip = 0;
+  incomingcall = 0;
+  callinprogress = 0;
+  answerincomingcall = 0;
+  callerId[0] = 0;
+#endif
+#if GSM_ENABLE_CLOCK
+  cclk_interval = GSM_CCLK_INTERVAL;
+  last_network_time = 0;
+  last_network_time_update = 0;
+  clock_reference_time = 0;
+  clock_reference_update = 0;
+  clock_drift = 0;
+  clts = 0;
+#endif
+  csq_interval = GSM_CSQ_INTERVAL;
+  cbc_interval = GSM_CBC_INTERVAL;
+  signal_quality = 99;
+  memset(&battery, 0, sizeof(battery));
+  work_pending = 1;
+  steps_idle = 0;
+  step_conditions = 0;
+  memset(timer_deadlines, 0, sizeof(timer_deadlines));
+  next_deadline = 0;
+  timers_armed = 0;
+  timers_due = bit(GSM_TIMER_CIPACK);
+  setTimer(GSM_TIMER_CSQ, GSM_CSQ_INTERVAL);
+  setTimer(GSM_TIMER_CBC, GSM_CBC_INTERVAL);
+  setTimer(GSM_TIMER_CREG, GSM_CREG_INTERVAL);
+#if GSM_ENABLE_CLOCK
+  setTimer(GSM_TIMER_CCLK, cclk_interval);
+#endif
+  GSM_STATS(resetStats());
+}
+
+void AsyncGSM::setRxBudget(uint16_t budget) {
+  rx_budget = budget;
+}
+
+void AsyncGSM::setPower(uint8_t power) {
+  work_pending = 1;
+  this->power = power;
+}
+
+uint8_t AsyncGSM::handlePowerState() {
+  uint8_t current_power = digitalRead(pstat);
+  if (!current_power && power && power_state == POWER_STATE_OFF) {
+    // start turning on
+    GSM_INFO_PRINT(F("Turning on. Current power: "));
+    GSM_INFO_PRINTLN(current_power);
+    power_state = POWER_STATE_STARTING;
+    digitalWrite(key, LOW);
+    setTimer(GSM_TIMER_POWER, GSM_POWER_KEY_MS);
+    return 0;
+  } else if (current_power && !power && power_state == POWER_STATE_ON) {
+    // start turning off
+    GSM_INFO_PRINT(F("Turning off. Current power: "));
+    GSM_INFO_PRINTLN(current_power);
+    power_state = POWER_STATE_STOPPING;
+    digitalWrite(key, LOW);
+    setTimer(GSM_TIMER_POWER, GSM_POWER_KEY_MS);
+    return 0;
+  } else if ((power_state == POWER_STATE_STOPPING || power_state == POWER_STATE_STARTING) && timerDue(GSM_TIMER_POWER)) {
+    // stop "pressing" key and reset power_state
+    GSM_INFO_PRINTLN(F("Release key button"));
+    digitalWrite(key, HIGH);
+    power_state = digitalRead(pstat);
+    GSM_INFO_PRINT(F("current_power: "));
+    GSM_INFO_PRINTLN(power_state);
+    resetModemState();
+    return power_state;
+  } else if (baud_state == BAUD_STATE_RESET) {
+    // the modem is held in reset after a failed baud rate switch
+    if (!timerDue(GSM_TIMER_POWER))
+      return 0;
+    digitalWrite(reset, HIGH);
+    baud_state = BAUD_STATE_FAILED;
+    resetModemState();
+    return current_power;
+  }
+
+  return current_power;
+}
+
+void AsyncGSM::resetModemState() {
+  GSM_TRACE_EVENT(GSM_EVENT_RESET, power_state);
+  if (modem_state == STATE_WAITING_REPLY) {
+    completeCommand(GSM_RESULT_ERROR, NULL);
+  }
+  echo = 0;
+#if GSM_ENABLE_SMS
+  cscs = 0;
+  cmgf = 0;
+  cnmi = 0;
+  cmms = 0;
+#endif
+#if GSM_ENABLE_CALLS
+  clip = 0;
+#endif
+  cipmux = 0;
+  cipqsend = 0;
+  cipmode = 0;
+  setDataMode(DATA_MODE_OFF);
+  ifc = 0;
+  creg_urc = 0;
+  if (baud_state != BAUD_STATE_OFF && baud_state != BAUD_STATE_FAILED) {
+    // the modem may have come back at either rate, check again
+    baud_state = BAUD_STATE_PENDING;
+  }
+  setRegistration(0);
+  modem_state = STATE_IDLE;
+  autobauding = 0;
+  command_state = COMMAND_NONE;
+  setGprsState(GPRS_STATE_UNKNOWN);
+  currentconnection = -1;
+  receive_remaining = 0;
+  setReceiveHold(0);
+  steps_idle = 0;
+}
+
+uint8_t AsyncGSM::initialize(Stream &serial)
+{
+  mySerial = &serial;
+  return 1;
+}
+
+void AsyncGSM::setDebugStream(Stream &stream)
+{
+  debugStream = &stream;
+}
+
+// The callback is called from within process() as soon as the modem
+// reports an event. It may read data and messages and queue work, but
+// must not call process().
+void AsyncGSM::setEventCallback(GSMEventCallback callback, void * context)
+{
+  event_callback = callback;
+  event_context = context;
+}
+
+// Moves the modem uart to a fixed rate with AT+IPR once the modem answers.
+// fallback is the rate the host opened the stream with. The callback must
+// reconfigure the stream to the rate it is given; it is called from
+// process() after the modem has acknowledged the switch, and again with
+// fallback if the new rate does not answer AT probes. If a restarted modem
+// does not answer at the current rate the bring-up alternates between the
+// two rates until it does.
+void AsyncGSM::setBaudRate(uint32_t baud, uint32_t fallback, GSMBaudCallback callback, void * context)
+{
+  work_pending = 1;
+  baud_callback = callback;
+  baud_context = context;
+  baud_target = baud;
+  baud_fallback = fallback;
+  if (baud_current == 0)
+    baud_current = fallback;
+  baud_failures = 0;
+  baud_state = callback ? BAUD_STATE_PENDING : BAUD_STATE_OFF;
+}
+
+// Rate the host uart was last set to, 0 if setBaudRate() was never called
+uint32_t AsyncGSM::getBaudRate() {
+  return baud_current;
+}
+
+void AsyncGSM::switchBaudRate(uint32_t baud) {
+  GSM_INFO_PRINT(F("Baud rate "));
+  GSM_INFO_PRINTLN(baud);
+  baud_current = baud;
+  baud_failures = 0;
+  baud_callback(baud_context, baud);
+}
+
+void AsyncGSM::notify(uint8_t event, int8_t connection) {
+  if (event_callback) {
+    event_callback(event_context, event, connection);
+  }
+}
+
+void AsyncGSM::setGprsState(int8_t state) {
+  int8_t previous = gprs_state;
+  gprs_state = state;
+  if (state == GPRS_STATE_IP_STATUS && previous != GPRS_STATE_IP_STATUS) {
+    notify(GSM_NOTIFY_GPRS_UP, -1);
+  } else if (state != GPRS_STATE_IP_STATUS && previous == GPRS_STATE_IP_STATUS) {
+    notify(GSM_NOTIFY_GPRS_DOWN, -1);
+  }
+}
+
+void AsyncGSM::setRegistration(int8_t state) {
+  int8_t previous = creg;
+  creg = state;
+  if (state == 2 && previous != 2) {
+    notify(GSM_NOTIFY_REGISTERED, -1);
+  } else if (state != 2 && previous == 2) {
+    notify(GSM_NOTIFY_UNREGISTERED, -1);
+  }
+}
+
+void AsyncGSM::closeAllConnections() {
+  for (uint8_t i = 0; i < NELEMS(connectionState); i++) {
+    uint8_t wasConnected = connectionState[i].connectionState == GPRS_STATE_CONNECT_OK;
+    connectionState[i].connectionState = GPRS_STATE_IP_INITIAL;
+    if (wasConnected)
+      notify(GSM_NOTIFY_CLOSED, i);
+  }
+}
+
+// Bookkeeping after outbound data went to the modem
+void AsyncGSM::sendComplete(int connection) {
+  if (bufferSize(&connectionState[connection].outboundCircular) == 0) {
+    // nothing is held back any more
+    connectionState[connection].flush = 0;
+    cancelTimer(GSM_TIMER_FLUSH + connection);
+  }
+  if (connectionState[connection].blocked) {
+    connectionState[connection].blocked = 0;
+    notify(GSM_NOTIFY_WRITABLE, connection);
+  }
+}
+
+#if GSM_TRACE_BUFFER_SIZE > 0
+// traceHead is the slot the next event goes to, traceCount the number of
+// events kept, which stops growing once the buffer is full
+void AsyncGSM::recordTrace(uint8_t event, uint16_t arg) {
+  GSMTraceEvent * entry = &traceBuffer[traceHead];
+  entry->time = millis();
+  entry->event = event;
+  entry->arg = arg;
+  if (++traceHead == GSM_TRACE_BUFFER_SIZE)
+    traceHead = 0;
+  if (traceCount < GSM_TRACE_BUFFER_SIZE)
+    traceCount++;
+}
+
+// Prints the recorded events, oldest first, as "time event arg" lines
+void AsyncGSM::dumpTrace(Stream &stream) {
+  // until the buffer has filled up the oldest event is in slot 0
+  uint16_t slot = traceCount < GSM_TRACE_BUFFER_SIZE ? 0 : traceHead;
+  for (uint16_t i = 0; i < traceCount; i++) {
+    GSMTraceEvent * entry = &traceBuffer[slot];
+    stream.print(entry->time);
+    stream.print(' ');
+    stream.print(entry->event);
+    stream.print(' ');
+    stream.println(entry->arg);
+    if (++slot == GSM_TRACE_BUFFER_SIZE)
+      slot = 0;
+  }
+}
+#endif
+
+#if GSM_ENABLE_STATS
+const GSMStats & AsyncGSM::getStats() {
+  return stats;
+}
+
+void AsyncGSM::resetStats() {
+  memset(&stats, 0, sizeof(stats));
+}
+
+static uint8_t latencyBucket(uint32_t ms) {
+  uint8_t bucket = 0;
+  for (uint32_t limit = 16; bucket < GSM_STATS_BUCKETS - 1 && ms >= limit; limit <<= 2) {
+    bucket++;
+  }
+  return bucket;
+}
+#endif
+
+// The circular buffers use free running head and tail counters masked by
+// the power-of-two capacity SIZE, so the whole buffer is usable and
+// head - tail is always the number of stored bytes.
+
+template <uint16_t SIZE>
+uint8_t AsyncGSM::writeBuffer(CircularBuffer<SIZE> * buffer, char data) {
+  // Cicular buffer is full
+  if (bufferSize(buffer) == SIZE)
+    return -1;  // quit with an error
+
+  buffer->buffer[buffer->head & (SIZE - 1)] = data;
+  buffer->head++;
+  return 0;
+}
+
+template <uint16_t SIZE>
+uint8_t AsyncGSM::readBuffer(CircularBuffer<SIZE> * buffer, char * data) {
+  // if the head isn't ahead of the tail, we don't have any characters
+  if (buffer->head == buffer->tail)
+    return -1;  // quit with an error
+
+  *data = buffer->buffer[buffer->tail & (SIZE - 1)];
+  buffer->tail++;
+  return 0;
+}
+
+template <uint16_t SIZE>
+uint16_t AsyncGSM::writeBuffer(CircularBuffer<SIZE> * buffer, const char * data, uint16_t len) {
+  uint16_t written = 0;
+  char * span;
+  uint16_t spanLen;
+  // at most two spans when the free space wraps around the end
+  while (written < len && (spanLen = writableSpan(buffer, &span)) > 0) {
+    if (spanLen > len - written)
+      spanLen = len - written;
+    memcpy(span, data + written, spanLen);
+    commit(buffer, spanLen);
+    written += spanLen;
+  }
+  return written;
+}
+
+template <uint16_t SIZE>
+uint16_t AsyncGSM::readBuffer(CircularBuffer<SIZE> * buffer, char * data, uint16_t len) {
+  uint16_t read = 0;
+  char * span;
+  uint16_t spanLen;
+  while (read < len && (spanLen = readableSpan(buffer, &span)) > 0) {
+    if (spanLen > len - read)
+      spanLen = len - read;
+    memcpy(data + read, span, spanLen);
+    consume(buffer, spanLen);
+    read += spanLen;
+  }
+  return read;
+}
+
+// Contiguous free space starting at head
+template <uint16_t SIZE>
+uint16_t AsyncGSM::writableSpan(CircularBuffer<SIZE> * buffer, char ** data) {
+  typename CircularBuffer<SIZE>::index_t start = buffer->head & (SIZE - 1);
+  uint16_t len = SIZE - bufferSize(buffer);
+  *data = buffer->buffer + start;
+  if (len > SIZE - start)
+    len = SIZE - start;
+  return len;
+}
+
+template <uint16_t SIZE>
+void AsyncGSM::commit(CircularBuffer<SIZE> * buffer, uint16_t len) {
+  buffer->head += len;
+}
+
+// Contiguous stored data starting at tail
+template <uint16_t SIZE>
+uint16_t AsyncGSM::readableSpan(CircularBuffer<SIZE> * buffer, char ** data) {
+  typename CircularBuffer<SIZE>::index_t start = buffer->tail & (SIZE - 1);
+  uint16_t len = bufferSize(buffer);
+  *data = buffer->buffer + start;
+  if (len > SIZE - start)
+    len = SIZE - start;
+  return len;
+}
+
+template <uint16_t SIZE>
+void AsyncGSM::consume(CircularBuffer<SIZE> * buffer, uint16_t len) {
+  buffer->tail += len;
+}
+
+template <uint16_t SIZE>
+uint16_t AsyncGSM::bufferSize(CircularBuffer<SIZE> * buffer) {
+  return (typename CircularBuffer<SIZE>::index_t)(buffer->head - buffer->tail);
+}
+
+uint16_t AsyncGSM::dataAvailable(int connection) {
+  return bufferSize(&connectionState[connection].inboundCircular);
+}
+
+uint16_t AsyncGSM::readData(char * data, uint16_t maxLen, int connection) {
+  uint16_t len = readBuffer(&connectionState[connection].inboundCircular, data, maxLen);
+  if (len > 0 && connection == receive_connection) {
+    // room again for the payload held back by RTS
+    setReceiveHold(0);
+  }
+  return len;
+}
+
+uint16_t AsyncGSM::outboundBufferSize(int connection) {
+  return bufferSize(&connectionState[connection].outboundCircular);
+}
+
+#if GSM_ENABLE_SMS
+// Returns the number of received messages waiting to be read
+uint8_t AsyncGSM::messageAvailable() {
+  return inbound_message_count;
+}
+
+// Returns the oldest received message, or NULL if there is none. The
+// message stays valid and may be modified in place until popMessage().
+ShortMessage * AsyncGSM::peekMessage() {
+  if (inbound_message_count == 0)
+    return NULL;
+  return &inboundMessages[inbound_message_head];
+}
+
+void AsyncGSM::popMessage() {
+  if (inbound_message_count == 0)
+    return;
+  inboundMessages[inbound_message_head].available = 0;
+  inbound_message_head = (inbound_message_head + 1) % GSM_SMS_QUEUE_SIZE;
+  inbound_message_count--;
+}
+
+// Number of messages dropped because the queue was full
+uint16_t AsyncGSM::messageOverflowCount() {
+  return inbound_message_overflow;
+}
+
+// Returns and removes the oldest received message, or a message with
+// available 0 if there is none
+ShortMessage AsyncGSM::readMessage() {
+  ShortMessage messageCopy;
+  if (inbound_message_count == 0) {
+    memset(&messageCopy, 0, sizeof(messageCopy));
+    return messageCopy;
+  }
+  messageCopy = inboundMessages[inbound_message_head];
+  popMessage();
+  return messageCopy;
+}
+
+// Queues a short message for sending. The callback is called with
+// GSM_SMS_QUEUED right away and later with GSM_SMS_SENT or GSM_SMS_FAILED.
+// Returns 0 if the outbox is full. A batch larger than the outbox can go
+// on from the callback, the next message queued there still shares the
+// relay link.
+uint8_t AsyncGSM::sendMessage(const ShortMessage & message, GSMMessageCallback callback, void * context) {
+  if (outbound_message_count >= GSM_SMS_OUTBOX_SIZE)
+    return 0;
+
+  OutboundMessage * entry = &outboundMessages[(outbound_message_head + outbound_message_count) % GSM_SMS_OUTBOX_SIZE];
+  entry->message = message;
+  entry->callback = callback;
+  entry->context = context;
+  outbound_message_count++;
+  work_pending = 1;
+  if (callback) {
+    callback(context, GSM_SMS_QUEUED, 0);
+  }
+  return 1;
+}
+
+uint8_t AsyncGSM::messageOutboxSize() {
+  return outbound_message_count;
+}
+
+// Removes the message at the head of the outbox and reports its status
+void AsyncGSM::completeOutboundMessage(uint8_t status) {
+  if (outbound_message_count == 0)
+    return;
+
+  OutboundMessage * entry = &outboundMessages[outbound_message_head];
+  GSMMessageCallback callback = entry->callback;
+  void * context = entry->context;
+  outbound_message_head = (outbound_message_head + 1) % GSM_SMS_OUTBOX_SIZE;
+  outbound_message_count--;
+  if (callback) {
+    callback(context, status, status == GSM_SMS_SENT ? outbound_message_reference : 0);
+  }
+}
+#endif
+
+#if GSM_ENABLE_CALLS
+int8_t AsyncGSM::incomingCall() {
+  return incomingcall;
+}
+
+char * AsyncGSM::getCallerIdentification() {
+  return callerId;
+}
+
+void AsyncGSM::answerIncomingCall() {
+  work_pending = 1;
+  if (incomingcall && !answerincomingcall && !callinprogress) {
+    answerincomingcall = 1;
+  }
+}
+
+void AsyncGSM::hangupCall() {
+  work_pending = 1;
+
+}
+#endif
+
+static const char stepAT[] PROGMEM = "AT";
+static const char stepATE0[] PROGMEM = "ATE0";
+#if GSM_ENABLE_CALLS
+static const char stepATA[] PROGMEM = "ATA";
+static const char stepCLIP[] PROGMEM = "AT+CLIP=1";
+#endif
+static const char stepCSQ[] PROGMEM = "AT+CSQ";
+static const char stepCBC[] PROGMEM = "AT+CBC";
+static const char stepCREG[] PROGMEM = "AT+CREG?";
+static const char stepWriteCREG[] PROGMEM = "AT+CREG=2";
+static const char stepCSCLK1[] PROGMEM = "AT+CSCLK=1";
+static const char stepCSCLK0[] PROGMEM = "AT+CSCLK=0";
+#if GSM_ENABLE_CLOCK
+static const char stepCLTS[] PROGMEM = "AT+CLTS=1";
+static const char stepCCLK[] PROGMEM = "AT+CCLK?";
+#endif
+static const char stepWriteCIPMUX[] PROGMEM = "AT+CIPMUX=1";
+static const char stepTestCIPMUX[] PROGMEM = "AT+CIPMUX?";
+static const char stepCIPQSEND1[] PROGMEM = "AT+CIPQSEND=1";
+static const char stepCIPQSEND0[] PROGMEM = "AT+CIPQSEND=0";
+static const char stepIFC2[] PROGMEM = "AT+IFC=2,2";
+static const char stepIFC0[] PROGMEM = "AT+IFC=0,0";
+static const char stepCIPSHUT[] PROGMEM = "AT+CIPSHUT";
+static const char stepCSTT[] PROGMEM = "AT+CSTT=\"internet.saunalahti\",\"\",\"\"";
+#if GSM_ENABLE_SMS
+static const char stepTestCNMI[] PROGMEM = "AT+CNMI?";
+static const char stepTestCMGF[] PROGMEM = "AT+CMGF?";
+static const char stepWriteCMGF[] PROGMEM = "AT+CMGF=1";
+static const char stepCSCS[] PROGMEM = "AT+CSCS=\"8859-1\"";
+static const char stepWriteCNMI[] PROGMEM = "AT+CNMI=2,2,0,0,0";
+#endif
+static const char stepCIICR[] PROGMEM = "AT+CIICR";
+static const char stepCIFSR[] PROGMEM = "AT+CIFSR";
+
+#define COND_READY (GSM_COND_AUTOBAUDING | GSM_COND_REGISTERED)
+#define COND_GPRS (COND_READY | GSM_COND_GPRS_REQUESTED)
+
+// Modem bring-up and housekeeping in order of precedence. The first step
+// whose required conditions are all set and excluded conditions all clear
+// is sent when the modem is idle.
+const GSMCommandStep gsmDefaultCommandSteps[] PROGMEM = {
+  // required, excluded, command, timeout, command state
+  { 0, GSM_COND_AUTOBAUDING, stepAT, 2000, COMMAND_NONE },
+  { GSM_COND_AUTOBAUDING, GSM_COND_ECHO, stepATE0, 5000, COMMAND_ATE },
+#if GSM_ENABLE_CALLS
+  { GSM_COND_ANSWER_CALL, 0, stepATA, 5000, COMMAND_ATA },
+#endif
+  { GSM_COND_AUTOBAUDING | GSM_COND_ECHO, GSM_COND_CREG_URC_CHECKED, stepWriteCREG, 5000, COMMAND_WRITE_CREG },
+  { GSM_COND_AUTOBAUDING | GSM_COND_ECHO | GSM_COND_IFC_REQUESTED, GSM_COND_IFC, stepIFC2, 5000, COMMAND_ENABLE_IFC },
+  { GSM_COND_AUTOBAUDING | GSM_COND_ECHO | GSM_COND_IFC, GSM_COND_IFC_REQUESTED, stepIFC0, 5000, COMMAND_DISABLE_IFC },
+  { GSM_COND_AUTOBAUDING | GSM_COND_CSQ_DUE, GSM_COND_TRANSMIT_PENDING | GSM_COND_POLLING_SUSPENDED, stepCSQ, 5000, COMMAND_CSQ },
+  { GSM_COND_AUTOBAUDING | GSM_COND_CBC_DUE, GSM_COND_TRANSMIT_PENDING | GSM_COND_POLLING_SUSPENDED, stepCBC, 5000, COMMAND_CBC },
+  { GSM_COND_AUTOBAUDING | GSM_COND_CREG_DUE, GSM_COND_REGISTERED, stepCREG, 5000, COMMAND_TEST_CREG },
+  // everything below waits for network registration
+  { COND_READY | GSM_COND_POWERSAVE_REQUESTED, GSM_COND_POWERSAVE, stepCSCLK1, 5000, COMMAND_ENABLE_POWERSAVE },
+  { COND_READY | GSM_COND_POWERSAVE, GSM_COND_POWERSAVE_REQUESTED, stepCSCLK0, 5000, COMMAND_DISABLE_POWERSAVE },
+#if GSM_ENABLE_CLOCK
+  { COND_READY, GSM_COND_CLTS, stepCLTS, 5000, COMMAND_SET_CLTS },
+#endif
+#if GSM_ENABLE_CALLS
+  { COND_READY, GSM_COND_CLIP, stepCLIP, 5000, COMMAND_WRITE_CLIP },
+#endif
+  { COND_READY | GSM_COND_CIPMUX_CHECKED, GSM_COND_CIPMUX, stepWriteCIPMUX, 5000, COMMAND_WRITE_CIPMUX },
+  { COND_READY, GSM_COND_CIPMUX_CHECKED, stepTestCIPMUX, 5000, COMMAND_TEST_CIPMUX },
+  { COND_READY | GSM_COND_QSEND_REQUESTED, GSM_COND_QSEND, stepCIPQSEND1, 5000, COMMAND_ENABLE_CIPQSEND },
+  { COND_READY | GSM_COND_QSEND, GSM_COND_QSEND_REQUESTED, stepCIPQSEND0, 5000, COMMAND_DISABLE_CIPQSEND },
+  { COND_GPRS | GSM_COND_GPRS_UNKNOWN, 0, stepCIPSHUT, 10000, COMMAND_CIPSHUT },
+  { COND_READY, GSM_COND_GPRS_IP_INITIAL | GSM_COND_GPRS_REQUESTED, stepCIPSHUT, 10000, COMMAND_CIPSHUT },
+  { COND_GPRS | GSM_COND_GPRS_IP_INITIAL, 0, stepCSTT, 10000, COMMAND_SET_CSTT },
+#if GSM_ENABLE_SMS
+  { COND_READY, GSM_COND_CNMI_CHECKED, stepTestCNMI, 10000, COMMAND_TEST_CNMI },
+  { COND_READY, GSM_COND_CMGF_CHECKED, stepTestCMGF, 10000, COMMAND_TEST_CMGF },
+  { COND_READY | GSM_COND_CMGF_CHECKED, GSM_COND_CMGF, stepWriteCMGF, 5000, COMMAND_WRITE_CMGF },
+  { COND_READY, GSM_COND_CSCS, stepCSCS, 5000, COMMAND_WRITE_CSCS },
+  { COND_READY | GSM_COND_CNMI_CHECKED, GSM_COND_CNMI, stepWriteCNMI, 60000, COMMAND_WRITE_CNMI },
+#endif
+#if GSM_ENABLE_CLOCK
+  { COND_READY | GSM_COND_CCLK_DUE, GSM_COND_TRANSMIT_PENDING | GSM_COND_POLLING_SUSPENDED, stepCCLK, 5000, COMMAND_TEST_CCLK },
+#endif
+  { COND_GPRS | GSM_COND_GPRS_IP_START, 0, stepCIICR, 120000, COMMAND_SET_CIICR },
+  { COND_GPRS | GSM_COND_GPRS_IP_GPRSACT, 0, stepCIFSR, 120000, COMMAND_CIFSR },
+};
+
+const uint8_t gsmDefaultCommandStepCount = NELEMS(gsmDefaultCommandSteps);
+
+// Replaces the bring-up and housekeeping table, steps must be in PROGMEM
+void AsyncGSM::setCommandSteps(const GSMCommandStep * steps, uint8_t count) {
+  work_pending = 1;
+  command_steps = steps;
+  command_step_count = count;
+}
+
+// Collects the state the command steps depend on into one bitmask
+uint32_t AsyncGSM::modemConditions() {
+  uint32_t conditions = 0;
+
+  if (autobauding) conditions |= GSM_COND_AUTOBAUDING;
+  if (echo) conditions |= GSM_COND_ECHO;
+#if GSM_ENABLE_CALLS
+  if (incomingcall && answerincomingcall) conditions |= GSM_COND_ANSWER_CALL;
+  if (clip) conditions |= GSM_COND_CLIP;
+#endif
+  if (timerDue(GSM_TIMER_CSQ)) conditions |= GSM_COND_CSQ_DUE;
+  if (timerDue(GSM_TIMER_CBC)) conditions |= GSM_COND_CBC_DUE;
+  if (timerDue(GSM_TIMER_CREG)) conditions |= GSM_COND_CREG_DUE;
+#if GSM_ENABLE_CLOCK
+  if (timerDue(GSM_TIMER_CCLK)) conditions |= GSM_COND_CCLK_DUE;
+  if (clts) conditions |= GSM_COND_CLTS;
+#endif
+  if (creg == 2) conditions |= GSM_COND_REGISTERED;
+  if (transmitPending()) conditions |= GSM_COND_TRANSMIT_PENDING;
+  if (enable_powersave) conditions |= GSM_COND_POWERSAVE_REQUESTED;
+  if (powersave) conditions |= GSM_COND_POWERSAVE;
+  if (enable_cipqsend) conditions |= GSM_COND_QSEND_REQUESTED;
+  if (cipqsend) conditions |= GSM_COND_QSEND;
+  if (enable_ifc) conditions |= GSM_COND_IFC_REQUESTED;
+  if (ifc) conditions |= GSM_COND_IFC;
+  if (cipmux) conditions |= GSM_COND_CIPMUX_CHECKED;
+  if (cipmux == (enable_cipmode ? 1 : 2)) conditions |= GSM_COND_CIPMUX;
+#if GSM_ENABLE_SMS
+  if (cnmi) conditions |= GSM_COND_CNMI_CHECKED;
+  if (cnmi == 2) conditions |= GSM_COND_CNMI;
+  if (cmgf) conditions |= GSM_COND_CMGF_CHECKED;
+  if (cmgf == 2) conditions |= GSM_COND_CMGF;
+  if (cscs) conditions |= GSM_COND_CSCS;
+#endif
+  if (enable_gprs) conditions |= GSM_COND_GPRS_REQUESTED;
+  if (creg_urc) conditions |= GSM_COND_CREG_URC_CHECKED;
+  if (polling_suspended) conditions |= GSM_COND_POLLING_SUSPENDED;
+
+  switch (gprs_state) {
+  case GPRS_STATE_UNKNOWN:
+  case GPRS_STATE_PDP_DEACT:
+    conditions |= GSM_COND_GPRS_UNKNOWN;
+    break;
+  case GPRS_STATE_IP_INITIAL:
+    conditions |= GSM_COND_GPRS_IP_INITIAL;
+    break;
+  case GPRS_STATE_IP_START:
+    conditions |= GSM_COND_GPRS_IP_START;
+    break;
+  case GPRS_STATE_IP_GPRSACT:
+    conditions |= GSM_COND_GPRS_IP_GPRSACT;
+    break;
+  }
+
+  return conditions;
+}
+
+// Sends the first command step matching the conditions. Returns 1 if a
+// command was sent.
+uint8_t AsyncGSM::sendCommandStep(uint32_t conditions) {
+  for (uint8_t i = 0; i < command_step_count; i++) {
+    GSMCommandStep step;
+    memcpy_P(&step, &command_steps[i], sizeof(step));
+    if ((conditions & step.required) != step.required || (conditions & step.excluded) != 0)
+      continue;
+
+    sendAtCommand(reinterpret_cast<GSMFlashStringPtr>(step.command), step.timeout);
+    beginCommand(step.command_state);
+
+    switch (command_state) {
+    case COMMAND_CSQ:
+      setTimer(GSM_TIMER_CSQ, pollInterval(csq_interval));
+      break;
+    case COMMAND_CBC:
+      setTimer(GSM_TIMER_CBC, pollInterval(cbc_interval));
+      break;
+    case COMMAND_TEST_CREG:
+      setTimer(GSM_TIMER_CREG, creg_urc == 2 ? GSM_CREG_URC_INTERVAL : GSM_CREG_INTERVAL);
+      break;
+#if GSM_ENABLE_CLOCK
+    case COMMAND_TEST_CCLK:
+      setTimer(GSM_TIMER_CCLK, cclk_interval);
+      break;
+#endif
+    }
+    return 1;
+  }
+  return 0;
+}
+
+// Sends the next command of an AT+IPR rate switch, if one is under way
+uint8_t AsyncGSM::sendBaudRateCommand() {
+  char command[24];
+  switch (baud_state) {
+  case BAUD_STATE_PENDING:
+    if (baud_current == baud_target) {
+      // the modem already answered at the new rate
+      baud_state = BAUD_STATE_DONE;
+      return 0;
+    }
+    sprintf(command, "AT+IPR=%lu", (unsigned long)baud_target);
+    sendAtCommand(command, 5000);
+    beginCommand(COMMAND_WRITE_IPR);
+    return 1;
+  case BAUD_STATE_PROBE:
+    sendAtCommand(F("AT"), GSM_BAUD_PROBE_TIMEOUT);
+    beginCommand(COMMAND_PROBE_IPR);
+    return 1;
+  case BAUD_STATE_RESTORE:
+    // the reply may not get through, the switch back happens regardless
+    sprintf(command, "AT+IPR=%lu", (unsigned long)baud_fallback);
+    sendAtCommand(command, GSM_BAUD_PROBE_TIMEOUT);
+    beginCommand(COMMAND_RESTORE_IPR);
+    return 1;
+  }
+  return 0;
+}
+
+// Marks the command just sent as the one in progress
+void AsyncGSM::beginCommand(int8_t state) {
+  command_state = state;
+  GSM_TRACE_EVENT(GSM_EVENT_COMMAND, state);
+  GSM_STATS(stats.commands[state].issued++);
+}
+
+// The deadline scheduler keeps one absolute deadline per timer and the
+// earliest of them in next_deadline, so a tick without an expired timer
+// costs a single comparison. Deadlines are compared by their signed
+// distance from millis(), which stays correct across the 49.7 day
+// wraparound for delays up to 24 days.
+
+void AsyncGSM::setTimer(uint8_t timer, uint32_t delay) {
+  uint32_t deadline = millis() + delay;
+  timer_deadlines[timer] = deadline;
+  timers_due &= ~bit(timer);
+  if (!timers_armed || (int32_t)(deadline - next_deadline) < 0)
+    next_deadline = deadline;
+  timers_armed |= bit(timer);
+}
+
+// next_deadline may now be early, which only costs an extra scan
+void AsyncGSM::cancelTimer(uint8_t timer) {
+  timers_armed &= ~bit(timer);
+  timers_due &= ~bit(timer);
+}
+
+uint8_t AsyncGSM::timerDue(uint8_t timer) {
+  return (timers_due & bit(timer)) != 0;
+}
+
+// Moves expired timers to timers_due and finds the next deadline
+void AsyncGSM::runTimers() {
+  uint32_t now = millis();
+  if (!timers_armed || (int32_t)(now - next_deadline) < 0)
+    return;
+
+  uint32_t next = GSM_NO_DEADLINE;
+  for (uint8_t i = 0; i < GSM_TIMER_COUNT; i++) {
+    if (!(timers_armed & bit(i)))
+      continue;
+    uint32_t remaining = timer_deadlines[i] - now;
+    if ((int32_t)remaining <= 0) {
+      timers_armed &= ~bit(i);
+      timers_due |= bit(i);
+    } else if (remaining < next) {
+      next = remaining;
+    }
+  }
+  next_deadline = now + next;
+}
+
+// Milliseconds until the earliest running timer expires, 0 if one already
+// has, or GSM_NO_DEADLINE if none is running
+uint32_t AsyncGSM::timeUntilNextDeadline() {
+  uint32_t now = millis();
+  uint32_t next = GSM_NO_DEADLINE;
+  for (uint8_t i = 0; i < GSM_TIMER_COUNT; i++) {
+    if (!(timers_armed & bit(i)))
+      continue;
+    int32_t remaining = timer_deadlines[i] - now;
+    if (remaining <= 0)
+      return 0;
+    if ((uint32_t)remaining < next)
+      next = remaining;
+  }
+  return next;
+}
+
+uint32_t AsyncGSM::pollInterval(uint32_t interval) {
+  return powersave ? interval * GSM_POWERSAVE_POLL_FACTOR : interval;
+}
+
+// Returns how many milliseconds process() has nothing to do unless data
+// arrives from the modem first: 0 if it should be called again right away,
+// GSM_NO_DEADLINE if only modem data can create work. Every state change
+// happens inside process() or in a call that sets work_pending, so a
+// process() call that left the modem idle has already sent whatever it
+// could and only an expiring timer can change that.
+uint32_t AsyncGSM::nextWakeup() {
+  if (work_pending || (!receive_hold && mySerial->available() > 0))
+    return 0;
+  return timeUntilNextDeadline();
+}
+
+// state machine
+uint16_t AsyncGSM::process() {
+
+  // the command steps are scanned again only once a call, an expired
+  // timer or modem data may have changed the conditions
+  if (work_pending)
+    steps_idle = 0;
+  work_pending = 0;
+  uint16_t due = timers_due;
+  runTimers();
+  if (timers_due != due)
+    steps_idle = 0;
+
+  uint8_t current_power = handlePowerState();
+  if (!current_power) {
+    steps_idle = 0;
+    return 0;
+  }
+
+  // drain everything the modem has sent, up to rx_budget bytes per call
+  uint16_t rx_bytes = 0;
+  uint8_t data_received = 0;  // connections that got payload and were not notified yet
+  int available;
+  while (data_mode == DATA_MODE_OFF && (rx_budget == 0 || rx_bytes < rx_budget) && (available = mySerial->available()) > 0) {
+    if (receive_remaining > 0 && receive_connection >= 0) {
+      // copy +RECEIVE payload from the serial straight into the inbound buffer
+      char * span;
+      uint16_t len = writableSpan(&connectionState[receive_connection].inboundCircular, &span);
+      if (len > receive_remaining)
+	len = receive_remaining;
+      if (len > available)
+	len = available;
+      if (rx_budget != 0 && len > rx_budget - rx_bytes)
+	len = rx_budget - rx_bytes;
+      if (len > 0) {
+	len = mySerial->readBytes(span, len);
+	commit(&connectionState[receive_connection].inboundCircular, len);
+	GSM_STATS(stats.connections[receive_connection].rxBytes += len);
+	receive_remaining -= len;
+	rx_bytes += len;
+	data_received |= bit(receive_connection);
+	continue;
+      }
+      if (data_received & bit(receive_connection)) {
+	// inbound buffer full, let the application read before the rest of
+	// the payload is held back or dropped
+	data_received &= ~bit(receive_connection);
+	notify(GSM_NOTIFY_DATA, receive_connection);
+	continue;
+      }
+      if (ifc) {
+	// leave the rest in the uart, the rts pin or the uart itself stops
+	// the modem
+	setReceiveHold(1);
+	break;
+      }
+    }
+    processIncomingModemByte(mySerial->read());
+    rx_bytes++;
+  }
+  for (uint8_t i = 0; data_received; i++, data_received >>= 1) {
+    if (data_received & 1)
+      notify(GSM_NOTIFY_DATA, i);
+  }
+
+  // in transparent data mode the serial link belongs to connection 0
+  if (data_mode != DATA_MODE_OFF) {
+    rx_bytes += transferTransparent();
+    if (data_mode != DATA_MODE_OFF)
+      return rx_bytes;
+  }
+  if (rx_bytes > 0)
+    steps_idle = 0;
+
+  // check for timeout
+  if (modem_state == STATE_WAITING_REPLY && timerDue(GSM_TIMER_COMMAND)) {
+    GSM_ERROR_PRINTLN(F("TIMEOUT"));
+    GSM_TRACE_EVENT(GSM_EVENT_TIMEOUT, command_state);
+    modem_state = STATE_IDLE;
+    completeCommand(GSM_RESULT_TIMEOUT, NULL);
+  }
+
+  // nothing can be sent until the modem has replied
+  if (modem_state != STATE_IDLE) {
+    return rx_bytes;
+  }
+
+  // switch to the fast uart rate before the rest of the bring-up
+  if (autobauding && echo && sendBaudRateCommand()) {
+    return rx_bytes;
+  }
+
+  // queued urc acknowledgements and user commands go before anything else
+  if (autobauding && sendQueuedCommand(GSM_PRIORITY_USER)) {
+    return rx_bytes;
+  }
+
+  if (sendTransparentSetup()) {
+    return rx_bytes;
+  }
+
+  // modem bring-up and housekeeping
+  if (!steps_idle) {
+    step_conditions = modemConditions();
+    if (sendCommandStep(step_conditions)) {
+      return rx_bytes;
+    }
+    steps_idle = 1;
+  }
+
+  if (!(step_conditions & GSM_COND_REGISTERED)) {
+    return rx_bytes;
+  }
+
+  // transparent mode has a single connection
+  uint8_t connectionCount = cipmode ? 1 : NELEMS(connectionState);
+  for (uint8_t i = 0; i < connectionCount; i++) {
+    if (modem_state == STATE_IDLE && 
+	gprs_state == GPRS_STATE_IP_STATUS && 
+	connectionState[i].connectionState != GPRS_STATE_CONNECT_OK && 
+	creg == 2 &&
+	strlen(connectionState[i].address) > 0 &&
+	connectionState[i].port != 0 &&
+	connectionState[i].connect &&
+	enable_gprs) {
+      char command[48];
+      if (cipmode) {
+	sprintf(command, "AT+CIPSTART=\"%s\",\"%s\",%u",
+		connectionState[i].type == CONNECTION_TYPE_TCP ? "TCP" : "UDP",
+		connectionState[i].address,
+		connectionState[i].port);
+      } else {
+	sprintf(command, "AT+CIPSTART=%u,\"%s\",\"%s\",%u",
+		i,
+		connectionState[i].type == CONNECTION_TYPE_TCP ? "TCP" : "UDP",
+		connectionState[i].address,
+		connectionState[i].port);
+      }
+      sendAtCommand(command, 60000);
+      beginCommand(COMMAND_WRITE_CIPSTART);
+      currentconnection = i;
+      return rx_bytes;
+    }
+  }
+
+
+  // serve connections round-robin so a busy connection cannot starve the others,
+  // in transparent mode the data goes out in data mode instead
+  for (uint8_t i = 0; i < NELEMS(connectionState) && !cipmode; i++) {
+    int j = (next_send_connection + i) % NELEMS(connectionState);
+    if (modem_state == STATE_IDLE && 
+	gprs_state == GPRS_STATE_IP_STATUS && 
+	sendReady(j) && creg == 2 && enable_gprs) {
+      if (cts_pin >= 0 && ifc && digitalRead(cts_pin) == HIGH) {
+	// the modem cannot take more data yet, check again shortly
+	setTimer(GSM_TIMER_CTS, GSM_CTS_POLL_MS);
+	break;
+      }
+      char command[24];
+      // send as much as the modem accepts in one CIPSEND
+      uint16_t len = bufferSize(&connectionState[j].outboundCircular);
+      if (len > GSM_MAX_SEND_SIZE)
+	len = GSM_MAX_SEND_SIZE;
+      if (cipqsend && connectionState[j].type == CONNECTION_TYPE_TCP) {
+	// in quick send mode keep at most qsend_budget bytes unacknowledged
+	uint32_t inflight = connectionState[j].sentBytes - connectionState[j].ackedBytes;
+	if (inflight >= qsend_budget)
+	  continue;
+	if (len > qsend_budget - inflight)
+	  len = qsend_budget - inflight;
+      }
+      connectionState[j].outboundBytes = len;
+      sprintf(command, "AT+CIPSEND=%u,%u", j, connectionState[j].outboundBytes);
+      sendAtCommand(command, 120000);
+      beginCommand(COMMAND_WRITE_CIPSEND);
+      currentconnection = j;
+      next_send_connection = (j + 1) % NELEMS(connectionState);
+      return rx_bytes;
+    }
+  }
+
+  // poll how much of the quick sent data the remote end has acknowledged
+  if (cipqsend && timerDue(GSM_TIMER_CIPACK)) {
+    for (uint8_t i = 0; i < NELEMS(connectionState); i++) {
+      if (gprs_state == GPRS_STATE_IP_STATUS &&
+	  connectionState[i].connectionState == GPRS_STATE_CONNECT_OK &&
+	  connectionState[i].type == CONNECTION_TYPE_TCP &&
+	  connectionState[i].sentBytes != connectionState[i].ackedBytes) {
+	char command[16];
+	sprintf(command, "AT+CIPACK=%u", i);
+	sendAtCommand(command, 5000);
+	beginCommand(COMMAND_CIPACK);
+	currentconnection = i;
+	setTimer(GSM_TIMER_CIPACK, GSM_CIPACK_INTERVAL);
+	return rx_bytes;
+      }
+    }
+  }
+
+  for (uint8_t i = 0; i < NELEMS(connectionState); i++) {
+    if (modem_state == STATE_IDLE && 
+	gprs_state == GPRS_STATE_IP_STATUS && 
+	connectionState[i].connectionState == GPRS_STATE_CONNECT_OK && 
+	creg == 2 &&
+	!connectionState[i].connect && enable_gprs) {
+      char command[32];
+      if (cipmode)
+	strcpy(command, "AT+CIPCLOSE");
+      else
+	sprintf(command, "AT+CIPCLOSE=%u,0", i);
+      sendAtCommand(command, 60000);
+      beginCommand(COMMAND_WRITE_CIPCLOSE);
+      currentconnection = i;
+      return rx_bytes;
+    }
+  }
+
+  
+  /*
+  if (millis() > last_udp_send + 120000) {
+    char data[16];
+    sprintf(data, "Test%u", millis());
+    writeData(data, strlen(data));
+    last_udp_send = millis();  
+  }
+  */
+
+#if GSM_ENABLE_SMS
+  if (modem_state == STATE_IDLE && outbound_message_count > 0 && autobauding && creg == 2) {
+    if (!cmms) {
+      // keep the relay link open for a few seconds after every message, so
+      // that messages sent in a row share it even through a one slot outbox
+      sendAtCommand(F("AT+CMMS=2"), 5000);
+      beginCommand(COMMAND_WRITE_CMMS);
+      return rx_bytes;
+    }
+    char command[64];
+    sprintf(command, "AT+CMGS=\"%s\"", outboundMessages[outbound_message_head].message.msisdn);
+    sendAtCommand(command, 60000);
+    beginCommand(COMMAND_WRITE_CMGS);
+    outbound_message_reference = 0;
+    return rx_bytes;
+  }
+#endif
+
+  // queued housekeeping commands run when there is nothing else to do
+  if (modem_state == STATE_IDLE && autobauding && sendQueuedCommand(GSM_PRIORITY_HOUSEKEEPING)) {
+    return rx_bytes;
+  }
+
+  // back to transparent data mode once the command work is done
+  if (modem_state == STATE_IDLE && cipmode && enable_cipmode && !command_hold &&
+      connectionState[0].connectionState == GPRS_STATE_CONNECT_OK && connectionState[0].connect) {
+    sendAtCommand(F("ATO"), 10000);
+    beginCommand(COMMAND_ATO);
+    currentconnection = 0;
+  }
+
+  return rx_bytes;
+}
+
+
+uint8_t AsyncGSM::isConnected(int connection) {
+  return connectionState[connection].connectionState == GPRS_STATE_CONNECT_OK;
+}
+
+uint8_t AsyncGSM::isModemIdle() {
+  return modem_state == STATE_IDLE;
+}
+
+uint8_t AsyncGSM::isModemError() {
+  return modem_state == STATE_ERROR;
+}
+
+uint8_t AsyncGSM::isModemRegistered() {
+  return creg == 2;
+}
+
+void AsyncGSM::enableGprs() {
+  work_pending = 1;
+  enable_gprs = 1;
+}
+
+void AsyncGSM::disableGprs() {
+  work_pending = 1;
+  enable_gprs = 0;
+}
+
+void AsyncGSM::enableQuickSend() {
+  work_pending = 1;
+  enable_cipqsend = 1;
+}
+
+void AsyncGSM::disableQuickSend() {
+  work_pending = 1;
+  enable_cipqsend = 0;
+}
+
+// Transparent mode (AT+CIPMODE=1) trades the multiplexed connections for
+// a single one, connection 0, whose data is bridged straight between the
+// serial link and its buffers without CIPSEND or +RECEIVE framing. The
+// modem is switched to single connection mode, so enable it before GPRS
+// comes up or any open connection is shut. Whenever commands, messages
+// or a disconnect are waiting the driver leaves data mode with the
+// guarded +++ escape and returns with ATO once they are done. Polls wait
+// for an empty outbound buffer; suspendPolling() keeps them out of a bulk
+// transfer altogether. GSM_NOTIFY_DATA_MODE and GSM_NOTIFY_COMMAND_MODE
+// report every switch.
+void AsyncGSM::enableTransparentMode() {
+  work_pending = 1;
+  enable_cipmode = 1;
+}
+
+void AsyncGSM::disableTransparentMode() {
+  work_pending = 1;
+  enable_cipmode = 0;
+}
+
+// Keeps the modem in command mode until releaseCommandMode()
+void AsyncGSM::holdCommandMode() {
+  work_pending = 1;
+  command_hold = 1;
+}
+
+void AsyncGSM::releaseCommandMode() {
+  work_pending = 1;
+  command_hold = 0;
+}
+
+// Returns 1 while the link is in transparent data mode and no AT
+// commands can be sent
+uint8_t AsyncGSM::isDataMode() {
+  return data_mode != DATA_MODE_OFF;
+}
+
+// Result codes that end data mode, recognized in the byte stream
+static const char resultClosed[] PROGMEM = "\r\nCLOSED\r\n";
+static const char resultOk[] PROGMEM = "\r\nOK\r\n";
+
+void AsyncGSM::setDataMode(int8_t mode) {
+  int8_t previous = data_mode;
+  if (result_match > 0) {
+    // a partly matched result code was data after all
+    char match[sizeof(resultClosed)];
+    memcpy_P(match, previous == DATA_MODE_ESCAPE ? resultOk : resultClosed, result_match);
+    writeBuffer(&connectionState[0].inboundCircular, match, result_match);
+    result_match = 0;
+  }
+  data_mode = mode;
+  if (mode == DATA_MODE_ON) {
+    receive_connection = 0;
+  }
+  if (mode == DATA_MODE_OFF) {
+    cancelTimer(GSM_TIMER_ESCAPE);
+    setReceiveHold(0);
+  }
+  if (mode == DATA_MODE_ON && previous == DATA_MODE_OFF) {
+    notify(GSM_NOTIFY_DATA_MODE, 0);
+  } else if (mode == DATA_MODE_OFF && previous != DATA_MODE_OFF) {
+    notify(GSM_NOTIFY_COMMAND_MODE, 0);
+  }
+}
+
+// Returns 1 if anything needs the modem in command mode
+uint8_t AsyncGSM::escapeNeeded() {
+  if (command_hold || !enable_cipmode || !connectionState[0].connect)
+    return 1;
+#if GSM_ENABLE_SMS
+  if (outbound_message_count > 0)
+    return 1;
+#endif
+  for (uint8_t i = 0; i < commandQueueLength; i++) {
+    if (commandQueue[i].priority <= GSM_PRIORITY_USER)
+      return 1;
+  }
+  // polls wait for a pause in the outbound data
+  uint16_t polls = bit(GSM_TIMER_CSQ) | bit(GSM_TIMER_CBC) | bit(GSM_TIMER_CCLK);
+  return (timers_due & polls) && !polling_suspended && bufferSize(&connectionState[0].outboundCircular) == 0;
+}
+
+// Takes one byte received in data mode. Bytes that may start a result
+// code are held back until the code is complete or ruled out.
+void AsyncGSM::receiveTransparent(char inByte) {
+  const char * code = data_mode == DATA_MODE_ESCAPE ? resultOk : resultClosed;
+  CircularBuffer<GSM_RX_BUFFER_SIZE> * inbound = &connectionState[0].inboundCircular;
+  if (inByte == (char)pgm_read_byte(&code[result_match])) {
+    if (pgm_read_byte(&code[++result_match]) != 0)
+      return;
+    result_match = 0;
+    if (code == resultClosed && connectionState[0].connectionState == GPRS_STATE_CONNECT_OK) {
+      connectionState[0].connectionState = GPRS_STATE_IP_INITIAL;
+      notify(GSM_NOTIFY_CLOSED, 0);
+    }
+    setDataMode(DATA_MODE_OFF);
+    return;
+  }
+  if (result_match > 0) {
+    char match[sizeof(resultClosed)];
+    memcpy_P(match, code, result_match);
+    writeBuffer(inbound, match, result_match);
+    result_match = 0;
+    if (inByte == (char)pgm_read_byte(&code[0])) {
+      result_match = 1;
+      return;
+    }
+  }
+  if (writeBuffer(inbound, inByte) == 0) {
+    GSM_STATS(stats.connections[0].rxBytes++);
+  } else {
+    GSM_STATS(stats.connections[0].droppedBytes++);
+  }
+}
+
+// Moves data between the serial link and connection 0 in data mode and
+// runs the +++ escape, returns the number of bytes read
+uint16_t AsyncGSM::transferTransparent() {
+  ConnectionState * state = &connectionState[0];
+  uint16_t rx_bytes = 0;
+  while (data_mode != DATA_MODE_OFF && (rx_budget == 0 || rx_bytes < rx_budget) && mySerial->available() > 0) {
+    if (GSM_RX_BUFFER_SIZE - bufferSize(&state->inboundCircular) <= result_match) {
+      // no room, leave the rest in the uart
+      setReceiveHold(1);
+      break;
+    }
+    receiveTransparent(mySerial->read());
+    rx_bytes++;
+  }
+  if (rx_bytes > 0) {
+    notify(GSM_NOTIFY_DATA, 0);
+  }
+
+  switch (data_mode) {
+  case DATA_MODE_ON:
+    if (escapeNeeded()) {
+      // the modem only takes +++ after a second of silence
+      mySerial->flush();
+      escape_attempts = 0;
+      data_mode = DATA_MODE_GUARD;
+      setTimer(GSM_TIMER_ESCAPE, GSM_ESCAPE_GUARD_MS);
+    } else if (sendReady(0) && (cts_pin < 0 || !ifc || digitalRead(cts_pin) == LOW)) {
+      char * span;
+      uint16_t len;
+      while ((len = readableSpan(&state->outboundCircular, &span)) > 0) {
+	mySerial->write(span, len);
+	consume(&state->outboundCircular, len);
+	state->sentBytes += len;
+	GSM_STATS(stats.connections[0].txBytes += len);
+      }
+      sendComplete(0);
+    }
+    break;
+  case DATA_MODE_GUARD:
+    if (timerDue(GSM_TIMER_ESCAPE)) {
+      GSM_TRACE_PRINTLN(F("--> +++"));
+      mySerial->write("+++");
+      mySerial->flush();
+      data_mode = DATA_MODE_ESCAPE;
+      setTimer(GSM_TIMER_ESCAPE, GSM_ESCAPE_GUARD_MS + GSM_DEFAULT_TIMEOUT_MS);
+    }
+    break;
+  case DATA_MODE_ESCAPE:
+    if (timerDue(GSM_TIMER_ESCAPE)) {
+      if (++escape_attempts < GSM_ESCAPE_ATTEMPTS) {
+	// no OK, try again after another guard time
+	setDataMode(DATA_MODE_GUARD);
+	setTimer(GSM_TIMER_ESCAPE, GSM_ESCAPE_GUARD_MS);
+      } else {
+	// the OK got lost in the data, the modem is in command mode by now
+	setDataMode(DATA_MODE_OFF);
+      }
+    }
+    break;
+  }
+  return rx_bytes;
+}
+
+// Brings the modem to the single connection and CIPMODE setting that
+// transparent mode needs, or back. Both can only change while no IP
+// connection is up, so anything already connected is shut first.
+uint8_t AsyncGSM::sendTransparentSetup() {
+  if (!autobauding || creg != 2 || !cipmux)
+    return 0;
+  uint8_t single = cipmux == 1;
+  if (enable_cipmode == cipmode && (!enable_cipmode || single))
+    return 0;
+  if (gprs_state != GPRS_STATE_IP_INITIAL) {
+    sendAtCommand(F("AT+CIPSHUT"), 10000);
+    beginCommand(COMMAND_CIPSHUT);
+  } else if (enable_cipmode && !single) {
+    sendAtCommand(F("AT+CIPMUX=0"), 5000);
+    beginCommand(COMMAND_DISABLE_CIPMUX);
+  } else if (enable_cipmode) {
+    sendAtCommand(F("AT+CIPMODE=1"), 5000);
+    beginCommand(COMMAND_ENABLE_CIPMODE);
+  } else {
+    sendAtCommand(F("AT+CIPMODE=0"), 5000);
+    beginCommand(COMMAND_DISABLE_CIPMODE);
+  }
+  return 1;
+}
+
+// Turns on RTS/CTS flow control on the modem uart with AT+IFC=2,2. While
+// the inbound buffer of the receiving connection is full the rest of the
+// data is left in the uart instead of being dropped. Pass -1 for a line
+// the host uart handles in hardware. Otherwise rtsPin drives the modem RTS
+// input, which is raised while reading is held, and ctsPin reads the modem
+// CTS output, which is checked before each CIPSEND. Both lines are active
+// low.
+void AsyncGSM::enableFlowControl(int8_t rtsPin, int8_t ctsPin) {
+  work_pending = 1;
+  enable_ifc = 1;
+  rts_pin = rtsPin;
+  cts_pin = ctsPin;
+  if (rts_pin >= 0) {
+    pinMode(rts_pin, OUTPUT);
+    digitalWrite(rts_pin, LOW);
+  }
+  if (cts_pin >= 0) {
+    pinMode(cts_pin, INPUT);
+  }
+}
+
+void AsyncGSM::disableFlowControl() {
+  work_pending = 1;
+  enable_ifc = 0;
+  setReceiveHold(0);
+  rts_pin = -1;
+  cts_pin = -1;
+}
+
+// Raises RTS to stop the modem while an inbound buffer has no room
+void AsyncGSM::setReceiveHold(uint8_t hold) {
+  if (hold != receive_hold && rts_pin >= 0) {
+    digitalWrite(rts_pin, hold ? HIGH : LOW);
+  }
+  if (!hold && receive_hold) {
+    work_pending = 1;
+  }
+  receive_hold = hold;
+}
+
+void AsyncGSM::setQuickSendBudget(uint16_t bytes) {
+  work_pending = 1;
+  qsend_budget = bytes;
+}
+
+uint32_t AsyncGSM::sentBytes(int connection) {
+  return connectionState[connection].sentBytes;
+}
+
+uint32_t AsyncGSM::acknowledgedBytes(int connection) {
+  return connectionState[connection].ackedBytes;
+}
+
+// Received signal strength of the last AT+CSQ, 0-31 (-113 to -51 dBm in
+// 2 dB steps) or 99 if not known
+uint8_t AsyncGSM::getSignalQuality() {
+  return signal_quality;
+}
+
+GSMBatteryStatus AsyncGSM::getBatteryStatus() {
+  return battery;
+}
+
+// Stops the signal, battery and clock polls, for example for the duration
+// of a transfer. Registration is still polled while not registered.
+void AsyncGSM::suspendPolling() {
+  polling_suspended = 1;
+}
+
+void AsyncGSM::resumePolling() {
+  work_pending = 1;
+  polling_suspended = 0;
+}
+
+void AsyncGSM::enablePowerSave() {
+  work_pending = 1;
+  enable_powersave = 1;
+}
+
+void AsyncGSM::disablePowerSave() {
+  work_pending = 1;
+  enable_powersave = 0;
+}
+
+uint8_t AsyncGSM::isGprsEnabled() {
+  return gprs_state == GPRS_STATE_IP_STATUS; 
+}
+
+uint8_t AsyncGSM::isGprsDisabled() {
+  return gprs_state == GPRS_STATE_UNKNOWN || gprs_state == GPRS_STATE_PDP_DEACT || gprs_state == GPRS_STATE_IP_INITIAL;
+}
+
+void AsyncGSM::connect(char * data, int port, int connection, int type) {
+  work_pending = 1;
+  memcpy(connectionState[connection].address, data, strlen(data) + 1);
+  connectionState[connection].port = port;
+  connectionState[connection].type = type;
+  connectionState[connection].connect = 1;
+}
+
+void AsyncGSM::disconnect(int connection) {
+  work_pending = 1;
+  connectionState[connection].address[0] = '\0';
+  connectionState[connection].port = 0;
+  connectionState[connection].connect = 0;
+}
+
+// Copies as much of data as fits in the outbound buffer and returns the
+// number of bytes taken. If some were refused GSM_NOTIFY_WRITABLE is sent
+// once the buffer has been drained into a CIPSEND.
+uint16_t AsyncGSM::writeData(char * data, int len, int connection) {
+  uint16_t buffered = bufferSize(&connectionState[connection].outboundCircular);
+  uint16_t written = writeBuffer(&connectionState[connection].outboundCircular, data, len);
+  if (written < len) {
+    connectionState[connection].blocked = 1;
+  }
+  if (buffered == 0 && written > 0 && connectionState[connection].coalesceHold > 0) {
+    // the hold time runs from the oldest unsent byte
+    setTimer(GSM_TIMER_FLUSH + connection, connectionState[connection].coalesceHold);
+  }
+  work_pending = 1;
+  GSM_STATS(stats.connections[connection].droppedBytes += len - written);
+  return written;
+}
+
+uint16_t AsyncGSM::availableForWrite(int connection) {
+  return GSM_TX_BUFFER_SIZE - bufferSize(&connectionState[connection].outboundCircular);
+}
+
+// Holds outbound data back until at least minBytes are buffered or the
+// oldest byte has waited maxHold ms, so small writes share one CIPSEND.
+// With maxHold 0 the data waits for minBytes or flush(). minBytes 0
+// sends whatever is buffered right away, which is the default.
+void AsyncGSM::setCoalescing(int connection, uint16_t minBytes, uint16_t maxHold) {
+  uint16_t limit = GSM_TX_BUFFER_SIZE < GSM_MAX_SEND_SIZE ? GSM_TX_BUFFER_SIZE : GSM_MAX_SEND_SIZE;
+  connectionState[connection].coalesceBytes = minBytes < limit ? minBytes : limit;
+  connectionState[connection].coalesceHold = maxHold;
+  work_pending = 1;
+}
+
+// Sends everything buffered on the connection without waiting for the
+// coalescing limits
+void AsyncGSM::flush(int connection) {
+  if (bufferSize(&connectionState[connection].outboundCircular) > 0) {
+    connectionState[connection].flush = 1;
+    work_pending = 1;
+  }
+}
+
+// Adds a command to the queue. The command is sent when the modem is idle,
+// urc acknowledgements first, then user commands and housekeeping last.
+// Every reply line is passed to the callback with GSM_RESULT_REPLY, or
+// GSM_RESULT_TRUNCATED if it did not fit GSM_LINE_BUFFER_SIZE, before the
+// final GSM_RESULT_OK, GSM_RESULT_ERROR or GSM_RESULT_TIMEOUT call. Lines
+// the modem may send unsolicited, like RING or +RECEIVE, are not replies.
+// If reply is given only lines starting with it are.
+// Returns 0 if the queue is full.
+uint8_t AsyncGSM::queueAtCommand(const char * command, uint32_t timeout, GSMCommandCallback callback, void * context, uint8_t priority, uint8_t expected, GSMFlashStringPtr reply) {
+  if (commandQueueLength >= NELEMS(commandQueue) || strlen(command) >= GSM_COMMAND_LENGTH)
+    return 0;
+
+  AtCommand * entry = &commandQueue[commandQueueLength++];
+  strcpy(entry->command, command);
+  entry->flashCommand = NULL;
+  entry->timeout = timeout;
+  entry->callback = callback;
+  entry->context = context;
+  entry->reply = reply;
+  entry->priority = priority;
+  entry->expected = expected;
+  work_pending = 1;
+  return 1;
+}
+
+uint8_t AsyncGSM::queueAtCommand(GSMFlashStringPtr command, uint32_t timeout, GSMCommandCallback callback, void * context, uint8_t priority, uint8_t expected, GSMFlashStringPtr reply) {
+  if (commandQueueLength >= NELEMS(commandQueue))
+    return 0;
+
+  AtCommand * entry = &commandQueue[commandQueueLength++];
+  entry->command[0] = 0;
+  entry->flashCommand = command;
+  entry->timeout = timeout;
+  entry->callback = callback;
+  entry->context = context;
+  entry->reply = reply;
+  entry->priority = priority;
+  entry->expected = expected;
+  work_pending = 1;
+  return 1;
+}
+
+uint8_t AsyncGSM::commandQueueSize() {
+  return commandQueueLength;
+}
+
+// Sends the oldest queued command of the most urgent priority class not
+// above maxPriority. Returns 1 if a command was sent.
+uint8_t AsyncGSM::sendQueuedCommand(uint8_t maxPriority) {
+  int8_t next = -1;
+  for (uint8_t i = 0; i < commandQueueLength; i++) {
+    if (commandQueue[i].priority <= maxPriority && (next < 0 || commandQueue[i].priority < commandQueue[next].priority)) {
+      next = i;
+    }
+  }
+  if (next < 0)
+    return 0;
+
+  AtCommand entry = commandQueue[next];
+  commandQueueLength--;
+  memmove(&commandQueue[next], &commandQueue[next + 1], (commandQueueLength - next) * sizeof(AtCommand));
+
+  if (entry.flashCommand) {
+    sendAtCommand(entry.flashCommand, entry.timeout);
+  } else {
+    sendAtCommand(entry.command, entry.timeout);
+  }
+  beginCommand(COMMAND_CUSTOM);
+  command_callback = entry.callback;
+  command_context = entry.context;
+  command_expected = entry.expected;
+  command_reply = entry.reply;
+  return 1;
+}
+
+// Reports the outcome of the command in progress to its callback
+void AsyncGSM::completeCommand(uint8_t result, const char * reply) {
+#if GSM_ENABLE_STATS
+  GSMCommandStats * commandStats = &stats.commands[command_state];
+  if (result == GSM_RESULT_TIMEOUT)
+    commandStats->timeouts++;
+  else if (result == GSM_RESULT_ERROR)
+    commandStats->errors++;
+  commandStats->latency[latencyBucket(millis() - last_command)]++;
+#endif
+  cancelTimer(GSM_TIMER_COMMAND);
+  GSMCommandCallback callback = command_callback;
+  command_callback = NULL;
+#if GSM_ENABLE_SMS
+  if (command_state == COMMAND_WRITE_CMMS && result != GSM_RESULT_OK) {
+    // send without holding the link if the modem does not support it
+    cmms = 1;
+  }
+#endif
+  if (command_state == COMMAND_WRITE_CREG && result != GSM_RESULT_OK) {
+    // no registration urcs, keep polling
+    creg_urc = 1;
+  }
+  if (command_state == COMMAND_NONE && !autobauding && result == GSM_RESULT_TIMEOUT &&
+      baud_state != BAUD_STATE_OFF && ++baud_failures >= GSM_BAUD_PROBE_RETRIES) {
+    // no answer at this rate, the modem may have restarted at the other one
+    switchBaudRate(baud_current == baud_target ? baud_fallback : baud_target);
+  }
+  if (command_state == COMMAND_WRITE_IPR) {
+    if (result == GSM_RESULT_OK) {
+      // the modem switches right after the OK
+      switchBaudRate(baud_target);
+      baud_state = BAUD_STATE_PROBE;
+    } else {
+      // rate not supported, or the reply was lost and the bring-up finds the modem again
+      baud_state = BAUD_STATE_FAILED;
+      if (result == GSM_RESULT_TIMEOUT)
+	autobauding = 0;
+    }
+  }
+  if (command_state == COMMAND_PROBE_IPR) {
+    if (result == GSM_RESULT_OK) {
+      baud_state = BAUD_STATE_DONE;
+    } else if (++baud_failures >= GSM_BAUD_PROBE_RETRIES) {
+      baud_state = BAUD_STATE_RESTORE;
+    }
+  }
+  if (command_state == COMMAND_RESTORE_IPR) {
+    // give up on the new rate, also for the bring-up after a restart
+    baud_target = baud_fallback;
+    switchBaudRate(baud_fallback);
+    autobauding = 0;
+    if (result == GSM_RESULT_OK) {
+      baud_state = BAUD_STATE_FAILED;
+    } else {
+      // the modem is stuck at a rate that does not work, AT+IPR is not
+      // saved without AT&W so a reset brings it back autobauding
+      GSM_ERROR_PRINTLN(F("Baud rate failed, resetting modem"));
+      digitalWrite(reset, LOW);
+      setTimer(GSM_TIMER_POWER, GSM_RESET_PULSE_MS);
+      baud_state = BAUD_STATE_RESET;
+    }
+  }
+  if ((command_state == COMMAND_ENABLE_CIPMODE || command_state == COMMAND_DISABLE_CIPMUX) && result != GSM_RESULT_OK) {
+    // no transparent mode on this modem
+    enable_cipmode = 0;
+  }
+  if (command_state == COMMAND_DISABLE_CIPMODE && result != GSM_RESULT_OK) {
+    cipmode = 0;
+  }
+  if (command_state == COMMAND_ATO && result != GSM_RESULT_OK) {
+    currentconnection = -1;
+    if (connectionState[0].connectionState == GPRS_STATE_CONNECT_OK) {
+      connectionState[0].connectionState = GPRS_STATE_IP_INITIAL;
+      notify(GSM_NOTIFY_CLOSED, 0);
+    }
+  }
+  if (command_state == COMMAND_DISABLE_IFC && result != GSM_RESULT_OK) {
+    ifc = 0;
+  }
+  if (command_state == COMMAND_ENABLE_CIPQSEND && result != GSM_RESULT_OK) {
+    // no quick send on this modem, every CIPSEND waits for SEND OK
+    enable_cipqsend = 0;
+  }
+  if (command_state == COMMAND_DISABLE_CIPQSEND && result != GSM_RESULT_OK) {
+    cipqsend = 0;
+  }
+  if (command_state == COMMAND_CIPACK) {
+    // a refused poll is tried again on the next interval
+    currentconnection = -1;
+  }
+  if (command_state == COMMAND_ENABLE_IFC && result != GSM_RESULT_OK) {
+    // the modem has no hardware flow control, carry on without it
+    enable_ifc = 0;
+    setReceiveHold(0);
+    rts_pin = -1;
+    cts_pin = -1;
+  }
+#if GSM_ENABLE_SMS
+  if (command_state == COMMAND_WRITE_CMGS) {
+    completeOutboundMessage(result == GSM_RESULT_OK ? GSM_SMS_SENT : GSM_SMS_FAILED);
+  }
+#endif
+  if (command_state == COMMAND_CUSTOM || command_state == COMMAND_WRITE_CMGS || command_state == COMMAND_WRITE_CMMS || command_state == COMMAND_WRITE_CREG ||
+      command_state == COMMAND_ENABLE_IFC || command_state == COMMAND_DISABLE_IFC ||
+      command_state == COMMAND_WRITE_IPR || command_state == COMMAND_PROBE_IPR || command_state == COMMAND_RESTORE_IPR ||
+      command_state == COMMAND_ENABLE_CIPMODE || command_state == COMMAND_DISABLE_CIPMODE ||
+      command_state == COMMAND_DISABLE_CIPMUX || command_state == COMMAND_ATO ||
+      command_state == COMMAND_ENABLE_CIPQSEND || command_state == COMMAND_DISABLE_CIPQSEND || command_state == COMMAND_CIPACK) {
+    // a failed user command, message or optional feature must not stall the
+    // state machine
+    if (modem_state == STATE_ERROR)
+      modem_state = STATE_IDLE;
+    command_state = COMMAND_NONE;
+  }
+  if (callback) {
+    callback(command_context, result, reply);
+  }
+}
+
+// Returns 1 if the connection has outbound data to send now, held back
+// data counts once it reaches the batch size or its hold time
+uint8_t AsyncGSM::sendReady(int connection) {
+  ConnectionState * state = &connectionState[connection];
+  uint16_t buffered = bufferSize(&state->outboundCircular);
+  if (state->connectionState != GPRS_STATE_CONNECT_OK || buffered == 0)
+    return 0;
+  return buffered >= state->coalesceBytes || state->flush || timerDue(GSM_TIMER_FLUSH + connection);
+}
+
+// Returns 1 if socket data, a short message or a queued user command is
+// waiting to be sent
+uint8_t AsyncGSM::transmitPending() {
+  for (uint8_t i = 0; i < NELEMS(connectionState); i++) {
+    if (sendReady(i)) {
+      return 1;
+    }
+  }
+  for (uint8_t i = 0; i < commandQueueLength; i++) {
+    if (commandQueue[i].priority <= GSM_PRIORITY_USER) {
+      return 1;
+    }
+  }
+  // data still arriving or quick sent data not yet acknowledged, a closed
+  // connection has nothing left to acknowledge
+  if (receive_remaining > 0)
+    return 1;
+  if (cipqsend) {
+    for (uint8_t i = 0; i < NELEMS(connectionState); i++) {
+      if (connectionState[i].connectionState == GPRS_STATE_CONNECT_OK &&
+	  connectionState[i].sentBytes != connectionState[i].ackedBytes) {
+	return 1;
+      }
+    }
+  }
+#if GSM_ENABLE_SMS
+  if (outbound_message_count > 0)
+    return 1;
+#endif
+#if GSM_ENABLE_CALLS
+  if (answerincomingcall)
+    return 1;
+#endif
+  return 0;
+}
+
+void AsyncGSM::sendAtCommand(const char * command, uint32_t timeout) {
+  GSM_TRACE_PRINT(F("--> ")); GSM_TRACE_PRINTLN(command);
+  mySerial->println(command);
+  last_command = millis();
+  setTimer(GSM_TIMER_COMMAND, timeout);
+  command_callback = NULL;
+  modem_state = STATE_WAITING_REPLY;
+  GSM_TRACE_PRINTLN(F("STATE_WAITING_REPLY"));
+}
+
+void AsyncGSM::sendAtCommand(GSMFlashStringPtr command, uint32_t timeout) {
+  GSM_TRACE_PRINT(F("--> ")); GSM_TRACE_PRINTLN(command);
+  mySerial->println(command);
+  last_command = millis();
+  setTimer(GSM_TIMER_COMMAND, timeout);
+  command_callback = NULL;
+  modem_state = STATE_WAITING_REPLY;
+  GSM_TRACE_PRINTLN(F("STATE_WAITING_REPLY"));
+}
+
+#if GSM_ENABLE_CLOCK
+time_t AsyncGSM::getCurrentTime() {
+  // correct the elapsed local time by the estimated oscillator drift. In
+  // 32 bits the correction is summed per 1000 s, per second and per ms.
+  uint32_t elapsed = millis() - last_network_time_update;
+  int32_t seconds = elapsed / 1000 % 1000;
+  int32_t ms = elapsed % 1000;
+  elapsed += (int32_t)(elapsed / 1000000) * clock_drift
+    + (seconds * clock_drift + ms * clock_drift / 1000) / 1000;
+  return last_network_time + elapsed / 1000;
+}
+
+// Estimated drift of millis() against the network time in parts per
+// million, positive when the local clock runs slow
+int32_t AsyncGSM::getClockDrift() {
+  return clock_drift;
+}
+
+// Takes a new network time sample. The drift is measured over the whole
+// span since the first sample, which averages out the one second
+// resolution of AT+CCLK?. While the drift corrected clock keeps within a
+// second of the network the poll interval is doubled, otherwise halved.
+void AsyncGSM::updateNetworkTime(time_t networkTime) {
+  uint32_t now = millis();
+  if (clock_reference_time == 0) {
+    clock_reference_time = networkTime;
+    clock_reference_update = now;
+  } else {
+    int32_t error = (int32_t)(networkTime - getCurrentTime());
+    uint32_t baseline = now - clock_reference_update;
+    if (error > GSM_CLOCK_STEP_LIMIT || error < -GSM_CLOCK_STEP_LIMIT || baseline >= 0x80000000UL) {
+      // the network time was set or the span no longer fits, start over
+      clock_reference_time = networkTime;
+      clock_reference_update = now;
+      cclk_interval = GSM_CCLK_INTERVAL;
+    } else {
+      if (baseline >= GSM_CLOCK_MIN_BASELINE) {
+	// ms the network gained on millis(), and from it the ppm drift
+	// as ms per second of baseline plus the fraction left over
+	int32_t offset = (int32_t)((uint32_t)(networkTime - clock_reference_time) * 1000 - baseline);
+	int32_t span = baseline / 1000;
+	int32_t whole = offset / span;
+	if (whole > -GSM_CLOCK_MAX_DRIFT / 1000 && whole < GSM_CLOCK_MAX_DRIFT / 1000)
+	  clock_drift = whole * 1000 + offset % span * 1000 / span;
+      }
+      if (error >= -1 && error <= 1) {
+	cclk_interval = cclk_interval * 2 < GSM_CCLK_MAX_INTERVAL ? cclk_interval * 2 : GSM_CCLK_MAX_INTERVAL;
+      } else {
+	cclk_interval = cclk_interval / 2 > GSM_CCLK_INTERVAL ? cclk_interval / 2 : GSM_CCLK_INTERVAL;
+      }
+    }
+  }
+  last_network_time = networkTime;
+  last_network_time_update = now;
+  setTimer(GSM_TIMER_CCLK, cclk_interval);
+}
+#endif
+
+// Returns the connection number of a "<n>, ..." line, or the connection of
+// the command in progress if the line carries no number
+int8_t AsyncGSM::parseConnectionNumber(const char * data) {
+  if (data[0] >= '0' && data[0] < '0' + (int)NELEMS(connectionState) && data[1] == ',') {
+    return data[0] - '0';
+  }
+  // in single connection mode everything is about connection 0
+  return cipmux == 1 ? 0 : currentconnection;
+}
+
+void AsyncGSM::processIncomingModemByte (const byte inByte) {
+
+  // payload of a +RECEIVE goes straight to the connection without line parsing
+  if (receive_remaining > 0) {
+    if (receive_connection >= 0) {
+      if (writeBuffer(&connectionState[receive_connection].inboundCircular, inByte) == 0) {
+	GSM_STATS(stats.connections[receive_connection].rxBytes++);
+      } else {
+	GSM_STATS(stats.connections[receive_connection].droppedBytes++);
+      }
+    }
+    receive_remaining--;
+    return;
+  }
+
+#if GSM_ENABLE_SMS
+  // the text of a +CMT goes straight into the message slot, it may be
+  // longer than a line
+  if (sms_body_pending) {
+    if (inByte == '\n') {
+      smsBodyComplete();
+    } else if (inByte != '\r' && sms_body_pending == 1) {
+      ShortMessage * message = &inboundMessages[(inbound_message_head + inbound_message_count) % GSM_SMS_QUEUE_SIZE];
+      if (input_modem_pos < sizeof(message->message) - 1)
+	message->message[input_modem_pos++] = inByte;
+    }
+    return;
+  }
+#endif
+
+  switch (inByte) {
+
+  case '\n':   // end of text
+    if (input_modem_pos > GSM_LINE_BUFFER_SIZE - 1) {
+      // the tail of the line is gone, parsing the rest could misread it,
+      // only the callback of a custom command gets to see it
+      GSM_ERROR_PRINTLN(F("Line too long"));
+      GSM_STATS(stats.overlongLines++);
+      input_modem_line[GSM_LINE_BUFFER_SIZE - 1] = 0;
+      if (modem_state == STATE_WAITING_REPLY && command_state == COMMAND_CUSTOM && command_callback &&
+	  isCommandReply(input_modem_line, classifyModemLine(input_modem_line))) {
+	command_callback(command_context, GSM_RESULT_TRUNCATED, input_modem_line);
+      }
+    } else {
+      input_modem_line[input_modem_pos] = 0;  // terminating null byte
+      process_modem_data (input_modem_line);
+    }
+
+    // reset buffer for next time
+    input_modem_pos = 0;
+    break;
+
+  case '\r':   // discard carriage return
+    break;
+
+  case '>':
+    // the prompt of CIPSEND and CMGS comes without a line end, elsewhere
+    // '>' is just text
+    if (input_modem_pos == 0) {
+      process_modem_data(">");
+      break;
+    }
+    // fall through
+
+  default:
+    // keep adding if not full ... allow for terminating null byte, past
+    // that only count so the line can be dropped
+    if (input_modem_pos < GSM_LINE_BUFFER_SIZE - 1)
+      input_modem_line [input_modem_pos] = inByte;
+    if (input_modem_pos < GSM_LINE_BUFFER_SIZE)
+      input_modem_pos++;
+    break;
+
+  }
+}
+
+#if GSM_ENABLE_SMS
+// Stores the message whose text has just ended and resets the line buffer
+void AsyncGSM::smsBodyComplete() {
+  uint8_t store = sms_body_pending == 1;
+  sms_body_pending = 0;
+  if (store) {
+    ShortMessage * message = &inboundMessages[(inbound_message_head + inbound_message_count) % GSM_SMS_QUEUE_SIZE];
+    message->message[input_modem_pos] = 0;
+    message->available = 1;
+    inbound_message_count++;
+    GSM_INFO_PRINTLN(message->msisdn);
+    GSM_INFO_PRINTLN(message->receive_time);
+    GSM_TRACE_PRINTLN(message->message);
+    notify(GSM_NOTIFY_MESSAGE, -1);
+  }
+  // otherwise the queue was full when the header arrived
+  input_modem_pos = 0;
+}
+#endif
+
+#if GSM_ENABLE_SMS || GSM_ENABLE_CLOCK
+// cumulative days before the first of each month in a common year
+static const uint16_t daysBeforeMonth[] PROGMEM = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+
+static uint8_t parseTwoDigits(const char * data) {
+  return (data[0] - '0') * 10 + (data[1] - '0');
+}
+
+// Converts a modem timestamp "yy/MM/dd,hh:mm:ss+zz" to seconds since 1970
+// UTC. The modem reports local time and the offset to UTC in quarter
+// hours. Years are 2000-2099, where every fourth year is a leap year.
+time_t AsyncGSM::parseTime(const char * data) {
+  uint8_t year = parseTwoDigits(data) + 30;  // years since 1970
+  uint8_t month = parseTwoDigits(data + 3);
+  if (month < 1 || month > 12)
+    month = 1;
+
+  uint32_t days = year * 365UL + (year + 1) / 4;  // leap days of 1972 onwards
+  days += pgm_read_word(&daysBeforeMonth[month - 1]);
+  if (month > 2 && (year + 2) % 4 == 0)
+    days++;
+  days += parseTwoDigits(data + 6) - 1;
+
+  uint32_t seconds = days * SECS_PER_DAY;
+  seconds += parseTwoDigits(data + 9) * SECS_PER_HOUR;
+  seconds += parseTwoDigits(data + 12) * SECS_PER_MIN;
+  seconds += parseTwoDigits(data + 15);
+
+  if ((data[17] == '+' || data[17] == '-') && data[18] >= '0' && data[18] <= '9' && data[19] >= '0' && data[19] <= '9') {
+    uint32_t offset = parseTwoDigits(data + 18) * 15 * SECS_PER_MIN;
+    if (data[17] == '+')
+      seconds -= offset;
+    else
+      seconds += offset;
+  }
+  return (time_t)seconds;
+}
+#endif
+
+#if GSM_ENABLE_SMS
+// Returns the start of the index:th comma separated field of data, commas
+// inside quotes do not count, or NULL if there are fewer fields
+static const char * findField(const char * data, uint8_t index) {
+  uint8_t quoted = 0;
+  while (index > 0) {
+    if (*data == 0)
+      return NULL;
+    if (*data == '"')
+      quoted = !quoted;
+    else if (*data == ',' && !quoted)
+      index--;
+    data++;
+  }
+  return data;
+}
+#endif
+
+// Returns non-zero if data starts with the given prefix
+static uint8_t startsWith(const char * data, const char * prefix) {
+  return strncmp(data, prefix, strlen(prefix)) == 0;
+}
+
+// Classify a line received from the modem by looking at its prefix only once.
+// The first character selects a small group of candidates so the cost is
+// bounded by the line length instead of the number of known replies.
+uint8_t AsyncGSM::classifyModemLine(const char * data) {
+  // result codes of a multiplexed connection are prefixed with "<n>, "
+  if (data[0] >= '0' && data[0] <= '9' && data[1] == ',' && data[2] == ' ') {
+    data += 3;
+  }
+
+  switch (data[0]) {
+  case 0:
+    return MODEM_LINE_EMPTY;
+  case '>':
+    return MODEM_LINE_PROMPT;
+  case '+':
+    switch (data[1]) {
+    case 'C':
+      switch (data[2]) {
+      case 'B':
+	if (startsWith(data, "+CBC:")) return MODEM_LINE_CBC;
+	break;
+      case 'C':
+	if (startsWith(data, "+CCLK:")) return MODEM_LINE_CCLK;
+	break;
+      case 'I':
+	if (startsWith(data, "+CIPMUX:")) return MODEM_LINE_CIPMUX;
+	if (startsWith(data, "+CIPACK:")) return MODEM_LINE_CIPACK;
+	break;
+      case 'L':
+	if (startsWith(data, "+CLIP:")) return MODEM_LINE_CLIP;
+	break;
+      case 'M':
+	if (startsWith(data, "+CMT:")) return MODEM_LINE_CMT;
+	if (startsWith(data, "+CMGF:")) return MODEM_LINE_CMGF;
+	if (startsWith(data, "+CMGS:")) return MODEM_LINE_CMGS;
+	if (startsWith(data, "+CME ERROR") || startsWith(data, "+CMS ERROR")) return MODEM_LINE_ERROR;
+	break;
+      case 'N':
+	if (startsWith(data, "+CNMI:")) return MODEM_LINE_CNMI;
+	break;
+      case 'R':
+	if (startsWith(data, "+CREG:")) return MODEM_LINE_CREG;
+	break;
+      case 'S':
+	if (startsWith(data, "+CSQ:")) return MODEM_LINE_CSQ;
+	break;
+      }
+      break;
+    case 'P':
+      if (startsWith(data, "+PDP: DEACT")) return MODEM_LINE_PDP_DEACT;
+      break;
+    case 'R':
+      if (startsWith(data, "+RECEIVE,")) return MODEM_LINE_RECEIVE;
+      break;
+    }
+    break;
+  case 'A':
+    if (startsWith(data, "ALREADY CONNECT")) return MODEM_LINE_ALREADY_CONNECT;
+    break;
+  case 'C':
+    if (startsWith(data, "CONNECT OK")) return MODEM_LINE_CONNECT_OK;
+    if (startsWith(data, "CONNECT FAIL")) return MODEM_LINE_CONNECT_FAIL;
+    if (startsWith(data, "CLOSED")) return MODEM_LINE_CLOSED;
+    if (startsWith(data, "CLOSE OK")) return MODEM_LINE_CLOSE_OK;
+    if (strcmp(data, "CONNECT") == 0) return MODEM_LINE_CONNECT;
+    break;
+  case 'D':
+    if (startsWith(data, "DATA ACCEPT:")) return MODEM_LINE_DATA_ACCEPT;
+    break;
+  case 'E':
+    if (strcmp(data, "ERROR") == 0) return MODEM_LINE_ERROR;
+    break;
+  case 'N':
+    if (startsWith(data, "NO CARRIER")) return MODEM_LINE_NO_CARRIER;
+    break;
+  case 'O':
+    if (strcmp(data, "OK") == 0) return MODEM_LINE_OK;
+    break;
+  case 'R':
+    if (strcmp(data, "RING") == 0) return MODEM_LINE_RING;
+    break;
+  case 'S':
+    if (startsWith(data, "SEND OK")) return MODEM_LINE_SEND_OK;
+    if (startsWith(data, "SEND FAIL")) return MODEM_LINE_SEND_FAIL;
+    if (startsWith(data, "SHUT OK")) return MODEM_LINE_SHUT_OK;
+    if (startsWith(data, "SMS Ready")) return MODEM_LINE_SMS_READY;
+    break;
+  }
+
+  return MODEM_LINE_UNKNOWN;
+}
+
+// Returns 1 if the line is part of the reply to the custom command in
+// progress rather than a final result code or an unsolicited line
+uint8_t AsyncGSM::isCommandReply(const char * data, uint8_t line) {
+  if (command_reply)
+    return strncmp_P(data, (const char *)command_reply, strlen_P((const char *)command_reply)) == 0;
+  switch (line) {
+  case MODEM_LINE_OK:
+  case MODEM_LINE_ERROR:
+  case MODEM_LINE_EMPTY:
+  case MODEM_LINE_RING:
+  case MODEM_LINE_NO_CARRIER:
+  case MODEM_LINE_SMS_READY:
+  case MODEM_LINE_CMT:
+  case MODEM_LINE_CLIP:
+  case MODEM_LINE_CREG:
+  case MODEM_LINE_RECEIVE:
+  case MODEM_LINE_PDP_DEACT:
+  case MODEM_LINE_CLOSED:
+    return 0;
+  }
+  return 1;
+}
+
+void AsyncGSM::process_modem_data (const char * data) {
+  GSM_TRACE_PRINT(F("<-- "));
+  GSM_TRACE_PRINTLN(data);
+
+  // the modem may leave a space after the '>' prompt in front of the next line
+  while (*data == ' ') {
+    data++;
+  }
+
+  uint8_t line = classifyModemLine(data);
+  GSM_TRACE_EVENT(GSM_EVENT_REPLY, line);
+  GSM_STATS(stats.lines[line]++);
+  uint8_t waiting = modem_state == STATE_WAITING_REPLY;
+
+  if (waiting && command_state == COMMAND_CUSTOM) {
+    if (line == command_expected && line != MODEM_LINE_OK) {
+      // custom command finished with its own final result code
+      modem_state = STATE_IDLE;
+    } else if (command_callback && isCommandReply(data, line)) {
+      command_callback(command_context, GSM_RESULT_REPLY, data);
+    }
+  }
+
+  switch (line) {
+
+  case MODEM_LINE_OK:
+    if (command_state == COMMAND_WRITE_CIPSTART) {
+      // CIPSTART completes with CONNECT OK / CONNECT FAIL
+      break;
+    }
+
+    if (command_state == COMMAND_CUSTOM && command_expected != MODEM_LINE_OK) {
+      // an interim OK, the custom command waits for its own final result code
+      break;
+    }
+
+    if (!autobauding) {
+      autobauding = 1;
+      baud_failures = 0;
+    }
+
+    if (command_state == COMMAND_ENABLE_POWERSAVE) {
+      powersave = 1;
+    }
+
+    if (command_state == COMMAND_DISABLE_POWERSAVE) {
+      powersave = 0;
+    }
+
+    if (command_state == COMMAND_ENABLE_CIPQSEND) {
+      cipqsend = 1;
+    }
+
+    if (command_state == COMMAND_DISABLE_CIPQSEND) {
+      cipqsend = 0;
+    }
+
+    if (command_state == COMMAND_ENABLE_IFC) {
+      ifc = 1;
+    }
+
+    if (command_state == COMMAND_ENABLE_CIPMODE) {
+      cipmode = 1;
+    }
+
+    if (command_state == COMMAND_DISABLE_CIPMODE) {
+      cipmode = 0;
+    }
+
+    if (command_state == COMMAND_DISABLE_CIPMUX) {
+      cipmux = 1;
+    }
+
+    if (command_state == COMMAND_DISABLE_IFC) {
+      ifc = 0;
+    }
+
+#if GSM_ENABLE_SMS
+    if (command_state == COMMAND_WRITE_CMMS) {
+      cmms = 2;
+    }
+#endif
+
+    if (command_state == COMMAND_WRITE_CREG) {
+      // urcs report changes from now on, query the current state right away
+      creg_urc = 2;
+      setTimer(GSM_TIMER_CREG, 0);
+    }
+    
+#if GSM_ENABLE_CALLS
+    if (command_state == COMMAND_ATA) {
+      callinprogress = 1;
+      answerincomingcall = 0;
+    }
+#endif
+    
+    if (command_state == COMMAND_ATE) {
+      echo = 1;
+    }
+
+    if (command_state == COMMAND_WRITE_CIPMUX) {
+      cipmux = 2;
+    }
+
+    if (command_state == COMMAND_SET_CSTT) {
+      setGprsState(GPRS_STATE_IP_START);
+    }
+
+#if GSM_ENABLE_SMS
+    if (command_state == COMMAND_WRITE_CNMI) {
+      cnmi = 2;
+    }
+#endif
+
+    if (command_state == COMMAND_SET_CIICR) {
+      setGprsState(GPRS_STATE_IP_GPRSACT);
+    }
+
+#if GSM_ENABLE_CLOCK
+    if (command_state == COMMAND_SET_CLTS) {
+      clts = 1;
+    }
+#endif
+
+#if GSM_ENABLE_SMS
+    if (command_state == COMMAND_WRITE_CMGF) {
+      cmgf = 2;
+    }
+
+    if (command_state == COMMAND_WRITE_CSCS) {
+      cscs = 1;
+    }
+#endif
+
+#if GSM_ENABLE_CALLS
+    if (command_state == COMMAND_WRITE_CLIP) {
+      clip = 1;
+    }
+#endif
+    
+    modem_state = STATE_IDLE;
+    GSM_TRACE_PRINTLN(F("STATE_IDLE"));
+    break;
+
+  case MODEM_LINE_ERROR:
+    modem_state = STATE_ERROR;
+    GSM_ERROR_PRINTLN(F("STATE_ERROR"));
+    GSM_TRACE_EVENT(GSM_EVENT_ERROR, command_state);
+    break;
+
+  case MODEM_LINE_PROMPT:
+    if (command_state == COMMAND_WRITE_CIPSEND) {
+      // write data straight from the outbound buffer, in two parts if it wraps
+      CircularBuffer<GSM_TX_BUFFER_SIZE> * outbound = &connectionState[currentconnection].outboundCircular;
+      uint16_t len = connectionState[currentconnection].outboundBytes;
+      connectionState[currentconnection].sentBytes += len;
+      GSM_TRACE_EVENT(GSM_EVENT_CIPSEND, len);
+      GSM_STATS(stats.connections[currentconnection].txBytes += len);
+      GSM_TRACE_PRINT(F("Writing to gsm serial"));
+      GSM_TRACE_PRINTLN(len);
+      while (len > 0) {
+	char * span;
+	uint16_t spanLen = readableSpan(outbound, &span);
+	if (spanLen > len)
+	  spanLen = len;
+	mySerial->write(span, spanLen);
+	consume(outbound, spanLen);
+	len -= spanLen;
+      }
+      mySerial->flush();
+      sendComplete(currentconnection);
+      GSM_TRACE_PRINTLN(F("Write ok."));
+#if GSM_ENABLE_SMS
+    } else if (command_state == COMMAND_WRITE_CMGS && outbound_message_count > 0) {
+      ShortMessage * message = &outboundMessages[outbound_message_head].message;
+      GSM_TRACE_PRINTLN(strlen(message->message));
+      GSM_TRACE_PRINT(F("--> ")); 
+      GSM_TRACE_PRINTLN(message->message);
+      mySerial->write(message->message, strlen(message->message));
+      mySerial->write("\x1A");
+      mySerial->flush();
+#endif
+    }
+    break;
+
+  case MODEM_LINE_SEND_OK:
+  case MODEM_LINE_SEND_FAIL:
+    if (command_state == COMMAND_WRITE_CIPSEND && parseConnectionNumber(data) == currentconnection) {
+      modem_state = STATE_IDLE;
+      currentconnection = -1;
+      GSM_TRACE_PRINTLN(F("STATE_IDLE"));
+    }
+    break;
+
+  case MODEM_LINE_DATA_ACCEPT:
+    // quick send mode: the modem has taken the data, no need to wait for the network
+    if (command_state == COMMAND_WRITE_CIPSEND && atoi(data + 12) == currentconnection) {
+      if (connectionState[currentconnection].type != CONNECTION_TYPE_TCP) {
+	// udp has nothing to acknowledge
+	connectionState[currentconnection].ackedBytes = connectionState[currentconnection].sentBytes;
+      }
+      modem_state = STATE_IDLE;
+      currentconnection = -1;
+      GSM_TRACE_PRINTLN(F("STATE_IDLE"));
+    }
+    break;
+
+#if GSM_ENABLE_SMS
+  case MODEM_LINE_CMGS:
+    if (command_state == COMMAND_WRITE_CMGS) {
+      outbound_message_reference = atoi(data + 6);
+    }
+    break;
+#endif
+
+  case MODEM_LINE_CIPACK:
+    // +CIPACK: <txlen>,<acklen>,<nacklen>
+    if (command_state == COMMAND_CIPACK && currentconnection >= 0) {
+      const char * acklen = strchr(data, ',');
+      if (acklen) {
+	connectionState[currentconnection].ackedBytes = strtoul(acklen + 1, NULL, 10);
+      }
+    }
+    break;
+
+  case MODEM_LINE_CONNECT_OK:
+  case MODEM_LINE_ALREADY_CONNECT:
+    {
+      int8_t connectionNumber = parseConnectionNumber(data);
+      if (connectionNumber >= 0) {
+	if (connectionState[connectionNumber].connectionState != GPRS_STATE_CONNECT_OK) {
+	  connectionState[connectionNumber].sentBytes = 0;
+	  connectionState[connectionNumber].ackedBytes = 0;
+	  connectionState[connectionNumber].connectionState = GPRS_STATE_CONNECT_OK;
+	  notify(GSM_NOTIFY_CONNECTED, connectionNumber);
+	}
+      }
+      if (command_state == COMMAND_WRITE_CIPSTART && connectionNumber == currentconnection) {
+	modem_state = STATE_IDLE;
+	currentconnection = -1;
+	GSM_TRACE_PRINTLN(F("STATE_IDLE"));
+      }
+    }
+    break;
+
+  case MODEM_LINE_CONNECT:
+    // transparent mode: from here on the link carries connection 0
+    if (command_state == COMMAND_WRITE_CIPSTART || command_state == COMMAND_ATO) {
+      if (connectionState[0].connectionState != GPRS_STATE_CONNECT_OK) {
+	connectionState[0].sentBytes = 0;
+	connectionState[0].ackedBytes = 0;
+	connectionState[0].connectionState = GPRS_STATE_CONNECT_OK;
+	notify(GSM_NOTIFY_CONNECTED, 0);
+      }
+      modem_state = STATE_IDLE;
+      currentconnection = -1;
+      setDataMode(DATA_MODE_ON);
+    }
+    break;
+
+  case MODEM_LINE_CONNECT_FAIL:
+    {
+      // tcp or udp connection failed
+      int8_t connectionNumber = parseConnectionNumber(data);
+      GSM_ERROR_PRINT(F("CONNECT FAIL "));
+      GSM_ERROR_PRINTLN(connectionNumber);
+      if (connectionNumber >= 0) {
+	connectionState[connectionNumber].connectionState = GPRS_STATE_IP_INITIAL;
+	notify(GSM_NOTIFY_CONNECT_FAILED, connectionNumber);
+      }
+      if (command_state == COMMAND_WRITE_CIPSTART && connectionNumber == currentconnection) {
+	modem_state = STATE_IDLE;
+	currentconnection = -1;
+	GSM_TRACE_PRINTLN(F("STATE_IDLE"));
+      }
+    }
+    break;
+
+  case MODEM_LINE_CLOSE_OK:
+  case MODEM_LINE_CLOSED:
+    {
+      // tcp or udp connection closed
+      int8_t connectionNumber = parseConnectionNumber(data);
+      if (connectionNumber >= 0 && connectionState[connectionNumber].connectionState == GPRS_STATE_CONNECT_OK) {
+	connectionState[connectionNumber].connectionState = GPRS_STATE_IP_INITIAL;
+	notify(GSM_NOTIFY_CLOSED, connectionNumber);
+      }
+      if (command_state == COMMAND_WRITE_CIPCLOSE && connectionNumber == currentconnection) {
+	modem_state = STATE_IDLE;
+	currentconnection = -1;
+	GSM_TRACE_PRINTLN(F("STATE_IDLE"));
+      }
+    }
+    break;
+
+  case MODEM_LINE_SHUT_OK:
+    if (command_state == COMMAND_CIPSHUT) {
+      // CIPSHUT closes every connection
+      closeAllConnections();
+      setGprsState(GPRS_STATE_IP_INITIAL);
+      modem_state = STATE_IDLE;
+      GSM_TRACE_PRINTLN(F("STATE_IDLE"));
+    }
+    break;
+
+  case MODEM_LINE_PDP_DEACT:
+    // the network dropped the bearer and every connection with it, the
+    // modem needs a CIPSHUT before GPRS can come up again
+    GSM_ERROR_PRINTLN(F("PDP deactivated"));
+    closeAllConnections();
+    setGprsState(GPRS_STATE_PDP_DEACT);
+    break;
+
+#if GSM_ENABLE_SMS
+  case MODEM_LINE_CMT:
+    if (inbound_message_count == GSM_SMS_QUEUE_SIZE) {
+      GSM_ERROR_PRINTLN(F("SMS queue full"));
+      inbound_message_overflow++;
+      sms_body_pending = 2;
+      break;
+    }
+    {
+      // parse the header straight into the next free slot
+      ShortMessage * message = &inboundMessages[(inbound_message_head + inbound_message_count) % GSM_SMS_QUEUE_SIZE];
+      // +CMT: "<oa>",[<alpha>],"<scts>"
+      const char * number = strchr(data, '"');
+      const char * end = number ? strchr(number + 1, '"') : NULL;
+      message->msisdn[0] = 0;
+      if (end && end - number - 1 < (int)sizeof(message->msisdn)) {
+	memcpy(message->msisdn, number + 1, end - number - 1);
+	message->msisdn[end - number - 1] = 0;
+      }
+      const char * timestamp = end ? findField(end + 1, 2) : NULL;
+      message->receive_time = 0;
+      if (timestamp && *timestamp == '"' && strlen(timestamp) > 17)
+	message->receive_time = parseTime(timestamp + 1);
+      sms_body_pending = 1;
+    }
+    break;
+#endif
+
+#if GSM_ENABLE_CLOCK
+  case MODEM_LINE_CCLK:
+    if (command_state == COMMAND_TEST_CCLK) {
+      updateNetworkTime(parseTime(data + 8));
+      GSM_TRACE_PRINT(F("current_time: "));
+      GSM_TRACE_PRINTLN(last_network_time);
+    }
+    break;
+#endif
+
+  case MODEM_LINE_CREG:
+    {
+      // the reply to AT+CREG? is "+CREG: <n>,<stat>[,<lac>,<ci>]", the urc
+      // "+CREG: <stat>[,"<lac>","<ci>"]" has no second unquoted number
+      const char * field = data + 6;
+      const char * next = strchr(field, ',');
+      if (next && next[1] >= '0' && next[1] <= '9')
+	field = next + 1;
+      int stat = atoi(field);
+      // 1 registered to the home network, 5 roaming
+      setRegistration(stat == 1 || stat == 5 ? 2 : 1);
+    }
+    break;
+
+  case MODEM_LINE_CSQ:
+    {
+      // +CSQ: <rssi>,<ber>, poll less often while the signal is steady
+      uint8_t rssi = atoi(data + 5);
+      int8_t change = rssi - signal_quality;
+      if (signal_quality == 99 || rssi == 99 || change >= GSM_CSQ_CHANGE || change <= -GSM_CSQ_CHANGE) {
+	csq_interval = GSM_CSQ_INTERVAL;
+      } else if (csq_interval < GSM_CSQ_MAX_INTERVAL) {
+	csq_interval = csq_interval * 2 < GSM_CSQ_MAX_INTERVAL ? csq_interval * 2 : GSM_CSQ_MAX_INTERVAL;
+      }
+      signal_quality = rssi;
+      setTimer(GSM_TIMER_CSQ, pollInterval(csq_interval));
+    }
+    break;
+
+  case MODEM_LINE_CBC:
+    {
+      // +CBC: <bcs>,<bcl>,<voltage>
+      const char * level = strchr(data, ',');
+      const char * voltage = level ? strchr(level + 1, ',') : NULL;
+      if (!voltage)
+	break;
+      uint8_t charging = atoi(data + 5);
+      uint8_t percent = atoi(level + 1);
+      int8_t change = percent - battery.level;
+      if (charging != battery.charging || change >= GSM_CBC_CHANGE || change <= -GSM_CBC_CHANGE) {
+	cbc_interval = GSM_CBC_INTERVAL;
+      } else if (cbc_interval < GSM_CBC_MAX_INTERVAL) {
+	cbc_interval = cbc_interval * 2 < GSM_CBC_MAX_INTERVAL ? cbc_interval * 2 : GSM_CBC_MAX_INTERVAL;
+      }
+      battery.charging = charging;
+      battery.level = percent;
+      battery.voltage = atoi(voltage + 1);
+      setTimer(GSM_TIMER_CBC, pollInterval(cbc_interval));
+    }
+    break;
+
+#if GSM_ENABLE_SMS
+  case MODEM_LINE_CNMI:
+    if (command_state == COMMAND_TEST_CNMI) {
+      const char * mode = data + 6;
+      while (*mode == ' ') {
+	mode++;
+      }
+      if (strcmp(mode, "2,2,0,0,0") != 0) {
+	cnmi = 1;
+      } else {
+	cnmi = 2;
+      }
+    }
+    break;
+
+  case MODEM_LINE_CMGF:
+    if (command_state == COMMAND_TEST_CMGF) {
+      if (strcmp(data + 6, " 1") == 0) {
+	cmgf = 2;
+      } else if (strcmp(data + 6, " 0") == 0) {
+	cmgf = 1;
+      }
+    }
+    break;
+#endif
+
+  case MODEM_LINE_CIPMUX:
+    if (command_state == COMMAND_TEST_CIPMUX) {
+      if (strcmp(data + 8, " 1") == 0) {
+	cipmux = 2;
+      } else if (strcmp(data + 8, " 0") == 0) {
+	cipmux = 1;
+      }
+    }
+    break;
+
+  case MODEM_LINE_RECEIVE:
+    {
+      // +RECEIVE,<n>,<len>: is followed by <len> bytes of raw payload
+      uint8_t connectionNumber = atoi(data + 9);
+      const char * length = strchr(data + 9, ',');
+      uint16_t availableData = length ? atoi(length + 1) : 0;
+      GSM_TRACE_PRINTLN(connectionNumber);
+      GSM_TRACE_PRINTLN(availableData);
+      receive_connection = connectionNumber < NELEMS(connectionState) ? connectionNumber : -1;
+      receive_remaining = availableData;
+      GSM_TRACE_EVENT(GSM_EVENT_RECEIVE, availableData);
+    }
+    break;
+
+#if GSM_ENABLE_CALLS
+  case MODEM_LINE_RING:
+    incomingcall = 1;
+    if (!clip) {
+      // with caller identification the event waits for the +CLIP line
+      notify(GSM_NOTIFY_RING, -1);
+    }
+    break;
+
+  case MODEM_LINE_CLIP:
+    {
+      // +CLIP: "<number>",<type>,...
+      const char * number = strchr(data, '"');
+      const char * end = number ? strchr(number + 1, '"') : NULL;
+      if (end && end - number - 1 < (int)sizeof(callerId)) {
+	memcpy(callerId, number + 1, end - number - 1);
+	callerId[end - number - 1] = 0;
+      }
+      notify(GSM_NOTIFY_RING, -1);
+    }
+    break;
+#endif
+
+  case MODEM_LINE_NO_CARRIER:
+    if (command_state == COMMAND_ATO) {
+      // the connection went away while in command mode
+      if (connectionState[0].connectionState == GPRS_STATE_CONNECT_OK) {
+	connectionState[0].connectionState = GPRS_STATE_IP_INITIAL;
+	notify(GSM_NOTIFY_CLOSED, 0);
+      }
+      modem_state = STATE_IDLE;
+      currentconnection = -1;
+      break;
+    }
+#if GSM_ENABLE_CALLS
+    incomingcall = 0;
+    callinprogress = 0;
+    answerincomingcall = 0;
+#endif
+    break;
+
+  case MODEM_LINE_SMS_READY:
+    GSM_INFO_PRINTLN(F("resetModemState()"));
+    resetModemState();
+    break;
+
+  case MODEM_LINE_UNKNOWN:
+    if (command_state == COMMAND_CIFSR) {
+      // the only reply to CIFSR is the local ip address
+      setGprsState(GPRS_STATE_IP_STATUS);
+      modem_state = STATE_IDLE;
+      GSM_TRACE_PRINTLN(F("STATE_IDLE"));
+    }
+    break;
+  }
+
+  if (waiting && modem_state != STATE_WAITING_REPLY) {
+    completeCommand(modem_state == STATE_ERROR ? GSM_RESULT_ERROR : GSM_RESULT_OK, data);
+  }
+}
@@ -1,230 +1,852 @@
-/*
-  AsyncGSM.h
-*/
-#ifndef AsyncGSM_h
-#define AsyncGSM_h
-
-#ifndef __AVR__
-#include <sys/types.h> // for __time_t_defined, but avr libc lacks sys/types.h
-#endif
-
-
-#if !defined(__time_t_defined) // avoid conflict with newlib or other posix libc
-typedef unsigned long time_t;
-#endif
-
-#define prog_char_strcmp(a, b)                                  strcmp_P((a), (b))
-#define prog_char_strstr(a, b)                                  strstr_P((a), (b))
-
-#define GSM_BUFFER_SIZE 128
-
-#define POWER_STATE_OFF 0
-#define POWER_STATE_ON 1
-#define POWER_STATE_STARTING 2
-#define POWER_STATE_STOPPING 3
-
-
-/* Useful Constants */
-#define SECS_PER_MIN  (60UL)
-#define SECS_PER_HOUR (3600UL)
-#define SECS_PER_DAY  (SECS_PER_HOUR * 24UL)
-#define DAYS_PER_WEEK (7UL)
-#define SECS_PER_WEEK (SECS_PER_DAY * DAYS_PER_WEEK)
-#define SECS_PER_YEAR (SECS_PER_WEEK * 52UL)
-#define SECS_YR_2000  (946684800UL) // the time at the start of y2k
-
-#define GSM_DEFAULT_TIMEOUT_MS 500
-#define MAX_INPUT 128
-
-#define STATE_IDLE 0
-#define STATE_WAITING_REPLY 1
-#define STATE_ERROR 2
-#define STATE_UCR 3
-
-#define CONNECTION_TYPE_TCP 0
-#define CONNECTION_TYPE_UDP 1
-
-#define GPRS_STATE_UNKNOWN 0
-#define GPRS_STATE_IP_INITIAL 1
-#define GPRS_STATE_IP_START 2
-#define GPRS_STATE_IP_CONFIG 3
-#define GPRS_STATE_IP_GPRSACT 4
-#define GPRS_STATE_IP_STATUS 5
-#define GPRS_STATE_PDP_DEACT 6
-#define GPRS_STATE_CONNECT_OK 7
-#define GPRS_STATE_CONNECTION_CLOSED 8
-
-#define COMMAND_NONE 0
-#define COMMAND_ATE 1
-#define COMMAND_WRITE_CIPMUX 2
-#define COMMAND_TEST_CIPMUX 7
-#define COMMAND_SET_CSTT 3
-#define COMMAND_SET_CIICR 4
-#define COMMAND_WRITE_CNMI 5
-#define COMMAND_TEST_CNMI 6
-#define COMMAND_CIPSTATUS 8
-#define COMMAND_CIPSHUT 9
-#define COMMAND_CBC 10
-#define COMMAND_CSQ 11
-#define COMMAND_SET_CLTS 12
-#define COMMAND_TEST_CCLK 13
-#define COMMAND_TEST_CREG 14
-#define COMMAND_CIFSR 15
-#define COMMAND_WRITE_CIPSTART 16
-#define COMMAND_WRITE_CIPSEND 17
-#define COMMAND_TEST_CMGF 18
-#define COMMAND_WRITE_CMGF 19
-#define COMMAND_UCR_CMT 20
-#define COMMAND_UCR_CMT_DATA 21
-#define COMMAND_TEST_CSCS 22
-#define COMMAND_WRITE_CSCS 23
-#define COMMAND_WRITE_CMGS 24
-#define COMMAND_WRITE_CLIP 25
-#define COMMAND_ATA 26
-#define COMMAND_WRITE_CIPCLOSE 27
-#define COMMAND_UCR_RECEIVE 28
-#define COMMAND_ENABLE_POWERSAVE 29
-#define COMMAND_DISABLE_POWERSAVE 30
-
-
-#define NELEMS(x)  (sizeof(x) / sizeof((x)[0]))
-
-#define prog_char_strcmp(a, b) strcmp_P((a), (b))
-
-#include "Arduino.h"
-
-#define prog_char  char PROGMEM
-
-typedef const __FlashStringHelper *GSMFlashStringPtr;
-
-typedef struct  {
-  uint8_t second;
-  uint8_t minute;
-  uint8_t hour;
-  uint8_t day;
-  uint8_t month;
-  uint8_t year;   // offset from 1970;
-} tmelements_t;
-
-
-typedef struct {
-  char buffer[GSM_BUFFER_SIZE];
-  size_t head;
-  size_t tail;
-} CircularBuffer;
-
-typedef struct {
-  uint8_t connectionState;
-  char address[16];
-  uint16_t port;
-  CircularBuffer outboundCircular;
-  CircularBuffer inboundCircular;
-  uint8_t connect : 1;
-  uint8_t type : 1;
-  uint8_t outboundBytes;
-} ConnectionState;
-
-typedef struct {
-  char message[161];
-  char msisdn[14];
-  time_t receive_time;
-  uint8_t available;
-} ShortMessage;
-
-class AsyncGSM
-{
- public:
-  AsyncGSM(uint8_t rst, uint8_t pstat, uint8_t key);
-  uint8_t initialize(Stream &serial);
-  void resetModemState();
-  void setDebugStream(Stream &debugStream);
-  void process();
-  void queueAtCommand(GSMFlashStringPtr command, uint32_t timeout);
-  void queueAtCommand(char * command, uint32_t timeout);
-  uint8_t isModemIdle();
-  uint8_t isModemError();
-  uint8_t isModemRegistered();
-  void enableGprs();
-  void disableGprs();
-  void enablePowerSave();
-  void disablePowerSave();
-  uint8_t isGprsEnabled();
-  uint8_t isGprsDisabled();
-  void connect(char * ipaddress, int port, int connection, int type);
-  void disconnect(int connection);
-  uint8_t isConnected(int connection);
-  uint8_t writeData(char * data, int len, int connection);
-  uint8_t messageAvailable();
-  uint8_t dataAvailable(int connection);
-  uint8_t outboundBufferSize(int connection);
-  ShortMessage readMessage();
-  void sendMessage(ShortMessage message);
-  time_t getCurrentTime();
-  int8_t incomingCall();
-  char * getCallerIdentification();
-  void answerIncomingCall();
-  void hangupCall();
-  void setPower(uint8_t power);
- protected:
-  uint8_t handlePowerState();
-  void processIncomingModemByte (const byte inByte);
-  void process_modem_data (char * data);
-  GSMFlashStringPtr ok_reply;
-  ConnectionState connectionState[1];
- private:  
-  uint8_t writeBuffer(CircularBuffer * buffer, char data);
-  uint8_t readBuffer(CircularBuffer * buffer, char * data);
-  uint8_t bufferSize(CircularBuffer * buffer);
-  uint8_t parseConnectionNumber(char * data);
-  Stream *mySerial;
-  Stream *debugStream;
-  time_t parseTime(char * timeString);
-  char input_modem_line [MAX_INPUT];
-  uint8_t input_modem_pos = 0;
-  int8_t modem_state;
-  int8_t command_state;
-  int8_t autobauding;
-  int8_t cipmux;
-  int8_t cipqsend;
-  int8_t gprs_state;
-  int8_t gprs_active;
-  uint8_t enable_gprs;
-  uint8_t enable_powersave;
-  uint8_t powersave;
-  int8_t ip_address;
-  int8_t echo;
-  int8_t cnmi;
-  int8_t clts;
-  int8_t cmgf;
-  int8_t cscs;
-  int8_t creg;
-  int8_t clip;
-  int8_t incomingcall;
-  int8_t callinprogress;
-  int8_t answerincomingcall;
-  int8_t currentconnection;
-  uint32_t last_time_update;
-  uint32_t last_csq_update;
-  uint32_t last_battery_update;
-  uint32_t last_creg;
-  uint32_t last_udp_send;
-  uint32_t last_command;
-  ShortMessage messageBuffer;
-  ShortMessage outboundMessage;
-  time_t last_network_time;
-  uint32_t last_network_time_update;
-  uint32_t command_timeout;
-  char callerId[14];
-
-  // power status
-  uint8_t power_state;
-  uint8_t power;
-  uint32_t power_state_changed;
-
-  // fona pins
-  uint8_t reset;
-  uint8_t pstat;
-  uint8_t key;
-};
-
-#endif
+/*
+  AsyncGSM.h
+*/
+#ifndef AsyncGSM_h
+#define AsyncGSM_h
+
+#ifndef __AVR__
+#include <sys/types.h> // for __time_t_defined, but avr libc lacks sys/types.h
+#endif
+
+
+#if !defined(__time_t_defined) // avoid conflict with newlib or other posix libc
+typedef unsigned long time_t;
+#endif
+
+#define prog_char_strcmp(a, b)                                  strcmp_P((a), (b))
+#define prog_char_strstr(a, b)                                  strstr_P((a), (b))
+
+#define GSM_BUFFER_SIZE 128
+
+// capacity of the outbound and inbound buffer of each connection, must be
+// a power of two. A transmit buffer of 2048 bytes lets every CIPSEND carry
+// a full GSM_MAX_SEND_SIZE segment.
+#ifndef GSM_TX_BUFFER_SIZE
+#define GSM_TX_BUFFER_SIZE GSM_BUFFER_SIZE
+#endif
+
+#ifndef GSM_RX_BUFFER_SIZE
+#define GSM_RX_BUFFER_SIZE GSM_BUFFER_SIZE
+#endif
+
+// largest payload the SIM800 accepts in a single AT+CIPSEND
+#ifndef GSM_MAX_SEND_SIZE
+#define GSM_MAX_SEND_SIZE 1460
+#endif
+
+// quick send mode (AT+CIPQSEND=1): default limit of unacknowledged tcp
+// bytes per connection and how often AT+CIPACK is polled
+#ifndef GSM_QSEND_BUDGET
+#define GSM_QSEND_BUDGET 4096
+#endif
+
+#ifndef GSM_CIPACK_INTERVAL
+#define GSM_CIPACK_INTERVAL 500
+#endif
+
+// number of simultaneous tcp/udp connections, the SIM800 supports up to 6
+#ifndef GSM_MAX_CONNECTIONS
+#define GSM_MAX_CONNECTIONS 1
+#endif
+
+#if GSM_MAX_CONNECTIONS < 1 || GSM_MAX_CONNECTIONS > 6
+#error "GSM_MAX_CONNECTIONS must be between 1 and 6"
+#endif
+
+// timers of the deadline scheduler
+#define GSM_TIMER_COMMAND 0
+#define GSM_TIMER_POWER 1
+#define GSM_TIMER_CSQ 2
+#define GSM_TIMER_CBC 3
+#define GSM_TIMER_CREG 4
+#define GSM_TIMER_CCLK 5
+#define GSM_TIMER_CIPACK 6
+#define GSM_TIMER_ESCAPE 7
+#define GSM_TIMER_CTS 8
+#define GSM_TIMER_FLUSH 9  // one per connection
+#define GSM_TIMER_COUNT (GSM_TIMER_FLUSH + GSM_MAX_CONNECTIONS)
+
+// returned by timeUntilNextDeadline() when no timer is running
+#define GSM_NO_DEADLINE 0xFFFFFFFFUL
+
+#define POWER_STATE_OFF 0
+#define POWER_STATE_ON 1
+#define POWER_STATE_STARTING 2
+#define POWER_STATE_STOPPING 3
+
+
+/* Useful Constants */
+#define SECS_PER_MIN  (60UL)
+#define SECS_PER_HOUR (3600UL)
+#define SECS_PER_DAY  (SECS_PER_HOUR * 24UL)
+#define DAYS_PER_WEEK (7UL)
+#define SECS_PER_WEEK (SECS_PER_DAY * DAYS_PER_WEEK)
+#define SECS_PER_YEAR (SECS_PER_WEEK * 52UL)
+#define SECS_YR_2000  (946684800UL) // the time at the start of y2k
+
+// housekeeping poll intervals in ms
+#ifndef GSM_CSQ_INTERVAL
+#define GSM_CSQ_INTERVAL 90000UL
+#endif
+
+#ifndef GSM_CBC_INTERVAL
+#define GSM_CBC_INTERVAL 60000UL
+#endif
+
+#ifndef GSM_CREG_INTERVAL
+#define GSM_CREG_INTERVAL 60000UL
+#endif
+
+// signal and battery polls back off up to these intervals while the
+// values stay within GSM_CSQ_CHANGE and GSM_CBC_CHANGE of the last poll
+#ifndef GSM_CSQ_MAX_INTERVAL
+#define GSM_CSQ_MAX_INTERVAL 720000UL
+#endif
+
+#ifndef GSM_CBC_MAX_INTERVAL
+#define GSM_CBC_MAX_INTERVAL 960000UL
+#endif
+
+#define GSM_CSQ_CHANGE 2
+#define GSM_CBC_CHANGE 2
+
+// registration poll interval when the modem reports changes with +CREG URCs
+#ifndef GSM_CREG_URC_INTERVAL
+#define GSM_CREG_URC_INTERVAL 600000UL
+#endif
+
+// while the modem is in AT+CSCLK sleep mode the signal and battery polls
+// run this many times less often so neither side wakes up needlessly
+#ifndef GSM_POWERSAVE_POLL_FACTOR
+#define GSM_POWERSAVE_POLL_FACTOR 10
+#endif
+
+// AT+IPR rate switch: unanswered probes of the new rate before falling
+// back, and unanswered bring-up ATs before the other rate is tried
+#ifndef GSM_BAUD_PROBE_RETRIES
+#define GSM_BAUD_PROBE_RETRIES 3
+#endif
+
+#ifndef GSM_BAUD_PROBE_TIMEOUT
+#define GSM_BAUD_PROBE_TIMEOUT 1000
+#endif
+
+// silence before and after the +++ that leaves transparent data mode, the
+// SIM800 wants at least a second, and how often the +++ is tried
+#ifndef GSM_ESCAPE_GUARD_MS
+#define GSM_ESCAPE_GUARD_MS 1100
+#endif
+
+#define GSM_ESCAPE_ATTEMPTS 3
+
+// how often a CTS pin held high by the modem is checked again
+#define GSM_CTS_POLL_MS 20
+
+// low pulse on the reset pin that returns the modem to autobauding
+#define GSM_RESET_PULSE_MS 150
+
+// how long the power key is held down
+#define GSM_POWER_KEY_MS 3000
+
+// AT+CCLK? poll interval while the local clock drift is unknown, and the
+// longest interval once the drift has been characterized
+#ifndef GSM_CCLK_INTERVAL
+#define GSM_CCLK_INTERVAL 120000UL
+#endif
+
+#ifndef GSM_CCLK_MAX_INTERVAL
+#define GSM_CCLK_MAX_INTERVAL 3600000UL
+#endif
+
+// shortest span of network time samples used to estimate the drift
+#ifndef GSM_CLOCK_MIN_BASELINE
+#define GSM_CLOCK_MIN_BASELINE 600000UL
+#endif
+
+#if GSM_CLOCK_MIN_BASELINE < 1000
+#error "GSM_CLOCK_MIN_BASELINE must be at least 1000"
+#endif
+
+// a network time this many seconds off the local clock is a time step
+#define GSM_CLOCK_STEP_LIMIT 60
+
+// drift estimates of this many ppm or more are not a clock error and are
+// ignored, which also keeps the 32 bit clock arithmetic from overflowing
+#define GSM_CLOCK_MAX_DRIFT 100000L
+
+// log levels, messages above GSM_LOG_LEVEL are compiled out
+#define GSM_LOG_OFF 0
+#define GSM_LOG_ERROR 1
+#define GSM_LOG_INFO 2
+#define GSM_LOG_TRACE 3
+
+#ifndef GSM_LOG_LEVEL
+#define GSM_LOG_LEVEL GSM_LOG_ERROR
+#endif
+
+// number of events kept in the binary trace buffer, 0 disables tracing
+#ifndef GSM_TRACE_BUFFER_SIZE
+#define GSM_TRACE_BUFFER_SIZE 0
+#endif
+
+#define GSM_EVENT_COMMAND 1
+#define GSM_EVENT_REPLY 2
+#define GSM_EVENT_TIMEOUT 3
+#define GSM_EVENT_ERROR 4
+#define GSM_EVENT_CIPSEND 5
+#define GSM_EVENT_RECEIVE 6
+#define GSM_EVENT_RESET 7
+
+// set to 1 to collect command, connection and line statistics, see getStats()
+#ifndef GSM_ENABLE_STATS
+#define GSM_ENABLE_STATS 0
+#endif
+
+// features that can be compiled out, a disabled feature takes no ram or
+// flash and the modem is not configured for it
+#ifndef GSM_ENABLE_SMS
+#define GSM_ENABLE_SMS 1
+#endif
+
+#ifndef GSM_ENABLE_CALLS
+#define GSM_ENABLE_CALLS 1
+#endif
+
+// network time sync with AT+CLTS and AT+CCLK?, see getCurrentTime()
+#ifndef GSM_ENABLE_CLOCK
+#define GSM_ENABLE_CLOCK 1
+#endif
+
+// if defined, the build fails when an AsyncGSM object takes more bytes.
+// There is no default: with every feature on the object takes more than
+// half the ram of an ATmega328, so each board sets its own budget.
+//#define GSM_RAM_BUDGET 1024
+
+// command latency histogram, bucket i counts replies faster than
+// 16 << (2 * i) ms and the last bucket everything slower
+#define GSM_STATS_BUCKETS 8
+
+#define GSM_DEFAULT_TIMEOUT_MS 500
+
+// longest modem line kept, with the terminating null. A longer reply to a
+// custom command reaches its callback cut short with GSM_RESULT_TRUNCATED,
+// any other longer line is dropped. The text of a received SMS bypasses
+// this buffer.
+#ifndef GSM_LINE_BUFFER_SIZE
+#define GSM_LINE_BUFFER_SIZE 128
+#endif
+
+#if GSM_LINE_BUFFER_SIZE < 32 || GSM_LINE_BUFFER_SIZE > 255
+#error "GSM_LINE_BUFFER_SIZE must be between 32 and 255"
+#endif
+
+// maximum number of bytes drained from the modem serial per process() call, 0 = unlimited
+#ifndef GSM_RX_BUDGET
+#define GSM_RX_BUDGET 256
+#endif
+
+#define STATE_IDLE 0
+#define STATE_WAITING_REPLY 1
+#define STATE_ERROR 2
+#define STATE_UCR 3
+
+#define CONNECTION_TYPE_TCP 0
+#define CONNECTION_TYPE_UDP 1
+
+#define BAUD_STATE_OFF 0
+#define BAUD_STATE_PENDING 1
+#define BAUD_STATE_PROBE 2
+#define BAUD_STATE_RESTORE 3
+#define BAUD_STATE_RESET 4
+#define BAUD_STATE_DONE 5
+#define BAUD_STATE_FAILED 6
+
+#define DATA_MODE_OFF 0     // command mode
+#define DATA_MODE_ON 1      // transparent, bytes pass straight through
+#define DATA_MODE_GUARD 2   // outbound stopped ahead of the +++ escape
+#define DATA_MODE_ESCAPE 3  // +++ sent, waiting for OK
+
+#define GPRS_STATE_UNKNOWN 0
+#define GPRS_STATE_IP_INITIAL 1
+#define GPRS_STATE_IP_START 2
+#define GPRS_STATE_IP_CONFIG 3
+#define GPRS_STATE_IP_GPRSACT 4
+#define GPRS_STATE_IP_STATUS 5
+#define GPRS_STATE_PDP_DEACT 6
+#define GPRS_STATE_CONNECT_OK 7
+#define GPRS_STATE_CONNECTION_CLOSED 8
+
+#define COMMAND_NONE 0
+#define COMMAND_ATE 1
+#define COMMAND_WRITE_CIPMUX 2
+#define COMMAND_TEST_CIPMUX 7
+#define COMMAND_SET_CSTT 3
+#define COMMAND_SET_CIICR 4
+#define COMMAND_WRITE_CNMI 5
+#define COMMAND_TEST_CNMI 6
+#define COMMAND_CIPSTATUS 8
+#define COMMAND_CIPSHUT 9
+#define COMMAND_CBC 10
+#define COMMAND_CSQ 11
+#define COMMAND_SET_CLTS 12
+#define COMMAND_TEST_CCLK 13
+#define COMMAND_TEST_CREG 14
+#define COMMAND_CIFSR 15
+#define COMMAND_WRITE_CIPSTART 16
+#define COMMAND_WRITE_CIPSEND 17
+#define COMMAND_TEST_CMGF 18
+#define COMMAND_WRITE_CMGF 19
+#define COMMAND_UCR_CMT 20
+#define COMMAND_UCR_CMT_DATA 21
+#define COMMAND_TEST_CSCS 22
+#define COMMAND_WRITE_CSCS 23
+#define COMMAND_WRITE_CMGS 24
+#define COMMAND_WRITE_CLIP 25
+#define COMMAND_ATA 26
+#define COMMAND_WRITE_CIPCLOSE 27
+#define COMMAND_UCR_RECEIVE 28
+#define COMMAND_ENABLE_POWERSAVE 29
+#define COMMAND_DISABLE_POWERSAVE 30
+#define COMMAND_CUSTOM 31
+#define COMMAND_ENABLE_CIPQSEND 32
+#define COMMAND_DISABLE_CIPQSEND 33
+#define COMMAND_CIPACK 34
+#define COMMAND_WRITE_CMMS 35
+#define COMMAND_WRITE_CREG 36
+#define COMMAND_ENABLE_IFC 37
+#define COMMAND_DISABLE_IFC 38
+#define COMMAND_WRITE_IPR 39
+#define COMMAND_PROBE_IPR 40
+#define COMMAND_RESTORE_IPR 41
+#define COMMAND_ENABLE_CIPMODE 42
+#define COMMAND_DISABLE_CIPMODE 43
+#define COMMAND_DISABLE_CIPMUX 44
+#define COMMAND_ATO 45
+#define GSM_COMMAND_COUNT 46
+
+// priority classes of queued commands, lower is more urgent
+#define GSM_PRIORITY_URC 0
+#define GSM_PRIORITY_USER 1
+#define GSM_PRIORITY_HOUSEKEEPING 2
+
+// results passed to command callbacks
+#define GSM_RESULT_OK 0
+#define GSM_RESULT_ERROR 1
+#define GSM_RESULT_TIMEOUT 2
+#define GSM_RESULT_REPLY 3
+#define GSM_RESULT_TRUNCATED 4  // a reply line longer than GSM_LINE_BUFFER_SIZE, cut short
+
+// status passed to outbound message callbacks
+#define GSM_SMS_QUEUED 0
+#define GSM_SMS_SENT 1
+#define GSM_SMS_FAILED 2
+
+// events passed to the event callback, connection is -1 where it does not apply
+#define GSM_NOTIFY_MESSAGE 0
+#define GSM_NOTIFY_DATA 1  // payload stored, once per process() call and whenever the inbound buffer fills
+#define GSM_NOTIFY_RING 2
+#define GSM_NOTIFY_CONNECTED 3
+#define GSM_NOTIFY_CLOSED 4
+#define GSM_NOTIFY_CONNECT_FAILED 5
+#define GSM_NOTIFY_GPRS_UP 6
+#define GSM_NOTIFY_GPRS_DOWN 7
+#define GSM_NOTIFY_REGISTERED 8
+#define GSM_NOTIFY_UNREGISTERED 9
+#define GSM_NOTIFY_WRITABLE 10  // a connection that refused data has room again
+#define GSM_NOTIFY_DATA_MODE 11  // transparent data mode, no AT commands until GSM_NOTIFY_COMMAND_MODE
+#define GSM_NOTIFY_COMMAND_MODE 12
+
+// conditions tested by the bring-up and housekeeping command steps
+#define GSM_COND_AUTOBAUDING (1UL << 0)
+#define GSM_COND_ECHO (1UL << 1)
+#define GSM_COND_ANSWER_CALL (1UL << 2)
+#define GSM_COND_CSQ_DUE (1UL << 3)
+#define GSM_COND_CBC_DUE (1UL << 4)
+#define GSM_COND_CREG_DUE (1UL << 5)
+#define GSM_COND_CCLK_DUE (1UL << 6)
+#define GSM_COND_REGISTERED (1UL << 7)
+#define GSM_COND_TRANSMIT_PENDING (1UL << 8)
+#define GSM_COND_POWERSAVE_REQUESTED (1UL << 9)
+#define GSM_COND_POWERSAVE (1UL << 10)
+#define GSM_COND_CLTS (1UL << 11)
+#define GSM_COND_CLIP (1UL << 12)
+#define GSM_COND_CIPMUX_CHECKED (1UL << 13)
+#define GSM_COND_CIPMUX (1UL << 14)
+#define GSM_COND_CNMI_CHECKED (1UL << 15)
+#define GSM_COND_CNMI (1UL << 16)
+#define GSM_COND_CMGF_CHECKED (1UL << 17)
+#define GSM_COND_CMGF (1UL << 18)
+#define GSM_COND_CSCS (1UL << 19)
+#define GSM_COND_GPRS_REQUESTED (1UL << 20)
+#define GSM_COND_GPRS_UNKNOWN (1UL << 21)
+#define GSM_COND_GPRS_IP_INITIAL (1UL << 22)
+#define GSM_COND_GPRS_IP_START (1UL << 23)
+#define GSM_COND_GPRS_IP_GPRSACT (1UL << 24)
+#define GSM_COND_QSEND_REQUESTED (1UL << 25)
+#define GSM_COND_QSEND (1UL << 26)
+#define GSM_COND_CREG_URC_CHECKED (1UL << 27)
+#define GSM_COND_POLLING_SUSPENDED (1UL << 28)
+#define GSM_COND_IFC_REQUESTED (1UL << 29)
+#define GSM_COND_IFC (1UL << 30)
+
+// number of received short messages kept until the application reads them,
+// every slot costs a ShortMessage (about 180 bytes). Messages that arrive
+// while the queue is full are dropped and counted, raise it for longer
+// bursts.
+#ifndef GSM_SMS_QUEUE_SIZE
+#define GSM_SMS_QUEUE_SIZE 2
+#endif
+
+// number of short messages waiting to be sent, every slot costs a
+// ShortMessage (about 180 bytes). Messages queued together go out over
+// one relay link, raise it for larger batches.
+#ifndef GSM_SMS_OUTBOX_SIZE
+#define GSM_SMS_OUTBOX_SIZE 2
+#endif
+
+// number of commands queueAtCommand() holds, two leave room for a urc
+// acknowledgement next to a user command. Every entry carries
+// GSM_COMMAND_LENGTH bytes of text for a command passed in RAM.
+#ifndef GSM_COMMAND_QUEUE_SIZE
+#define GSM_COMMAND_QUEUE_SIZE 2
+#endif
+
+// longest command passed in RAM, with the terminating null
+#ifndef GSM_COMMAND_LENGTH
+#define GSM_COMMAND_LENGTH 48
+#endif
+
+#define MODEM_LINE_UNKNOWN 0
+#define MODEM_LINE_EMPTY 1
+#define MODEM_LINE_OK 2
+#define MODEM_LINE_ERROR 3
+#define MODEM_LINE_PROMPT 4
+#define MODEM_LINE_RING 5
+#define MODEM_LINE_NO_CARRIER 6
+#define MODEM_LINE_SMS_READY 7
+#define MODEM_LINE_SHUT_OK 8
+#define MODEM_LINE_CONNECT_OK 9
+#define MODEM_LINE_CONNECT_FAIL 10
+#define MODEM_LINE_ALREADY_CONNECT 11
+#define MODEM_LINE_CLOSED 12
+#define MODEM_LINE_CLOSE_OK 13
+#define MODEM_LINE_SEND_OK 14
+#define MODEM_LINE_SEND_FAIL 15
+#define MODEM_LINE_CMT 16
+#define MODEM_LINE_CCLK 17
+#define MODEM_LINE_CREG 18
+#define MODEM_LINE_CNMI 19
+#define MODEM_LINE_CMGF 20
+#define MODEM_LINE_CIPMUX 21
+#define MODEM_LINE_RECEIVE 22
+#define MODEM_LINE_CSQ 23
+#define MODEM_LINE_CBC 24
+#define MODEM_LINE_CLIP 25
+#define MODEM_LINE_CMGS 26
+#define MODEM_LINE_DATA_ACCEPT 27
+#define MODEM_LINE_CIPACK 28
+#define MODEM_LINE_CONNECT 29
+#define MODEM_LINE_PDP_DEACT 30
+#define MODEM_LINE_COUNT 31
+
+
+#define NELEMS(x)  (sizeof(x) / sizeof((x)[0]))
+
+#define prog_char_strcmp(a, b) strcmp_P((a), (b))
+
+#include "Arduino.h"
+
+#define prog_char  char PROGMEM
+
+typedef const __FlashStringHelper *GSMFlashStringPtr;
+
+typedef struct  {
+  uint8_t second;
+  uint8_t minute;
+  uint8_t hour;
+  uint8_t day;
+  uint8_t month;
+  uint8_t year;   // offset from 1970;
+} tmelements_t;
+
+
+// smallest type that can count to the buffer capacity
+template <bool SMALL> struct CircularBufferIndex { typedef uint16_t type; };
+template <> struct CircularBufferIndex<true> { typedef uint8_t type; };
+
+template <uint16_t SIZE>
+struct CircularBuffer {
+  static_assert(SIZE > 0 && (SIZE & (SIZE - 1)) == 0 && SIZE <= 32768,
+		"circular buffer size must be a power of two up to 32768");
+  typedef typename CircularBufferIndex<SIZE <= 128>::type index_t;
+  char buffer[SIZE];
+  index_t head;
+  index_t tail;
+};
+
+typedef struct {
+  uint8_t connectionState;
+  char address[16];
+  uint16_t port;
+  CircularBuffer<GSM_TX_BUFFER_SIZE> outboundCircular;
+  CircularBuffer<GSM_RX_BUFFER_SIZE> inboundCircular;
+  uint8_t connect : 1;
+  uint8_t type : 1;
+  uint8_t flush : 1;
+  uint8_t blocked : 1;  // writeData refused bytes since the last send
+  uint16_t outboundBytes;
+  uint16_t coalesceBytes;
+  uint16_t coalesceHold;
+  uint32_t sentBytes;
+  uint32_t ackedBytes;
+} ConnectionState;
+
+typedef struct {
+  uint32_t time;
+  uint8_t event;
+  uint16_t arg;
+} GSMTraceEvent;
+
+typedef struct {
+  uint16_t issued;
+  uint16_t timeouts;
+  uint16_t errors;
+  uint16_t latency[GSM_STATS_BUCKETS];
+} GSMCommandStats;
+
+typedef struct {
+  uint32_t txBytes;
+  uint32_t rxBytes;
+  uint32_t droppedBytes;  // outbound bytes refused by writeData and inbound bytes lost to a full buffer
+} GSMConnectionStats;
+
+// Counters are free running, compare two snapshots to get rates
+typedef struct {
+  GSMCommandStats commands[GSM_COMMAND_COUNT];
+  GSMConnectionStats connections[GSM_MAX_CONNECTIONS];
+  uint32_t lines[MODEM_LINE_COUNT];
+  uint32_t overlongLines;  // lines cut short or dropped for not fitting GSM_LINE_BUFFER_SIZE
+} GSMStats;
+
+typedef void (*GSMCommandCallback)(void * context, uint8_t result, const char * reply);
+
+typedef void (*GSMEventCallback)(void * context, uint8_t event, int8_t connection);
+
+// reconfigures the host uart to baud
+typedef void (*GSMBaudCallback)(void * context, uint32_t baud);
+
+typedef struct {
+  char command[GSM_COMMAND_LENGTH];
+  GSMFlashStringPtr flashCommand;
+  uint32_t timeout;
+  GSMCommandCallback callback;
+  void * context;
+  GSMFlashStringPtr reply;
+  uint8_t priority;
+  uint8_t expected;
+} AtCommand;
+
+// One step of the modem bring-up and housekeeping table, kept in PROGMEM
+typedef struct {
+  uint32_t required;
+  uint32_t excluded;
+  const char * command;
+  uint32_t timeout;
+  uint8_t command_state;
+} GSMCommandStep;
+
+extern const GSMCommandStep gsmDefaultCommandSteps[];
+extern const uint8_t gsmDefaultCommandStepCount;
+
+typedef struct {
+  uint8_t charging;  // 0 not charging, 1 charging, 2 charging finished
+  uint8_t level;     // percent
+  uint16_t voltage;  // mV
+} GSMBatteryStatus;
+
+typedef struct {
+  char message[161];
+  char msisdn[14];
+  time_t receive_time;
+  uint8_t available;
+} ShortMessage;
+
+// reference is the +CMGS message reference of a sent message
+typedef void (*GSMMessageCallback)(void * context, uint8_t status, uint8_t reference);
+
+typedef struct {
+  ShortMessage message;
+  GSMMessageCallback callback;
+  void * context;
+} OutboundMessage;
+
+class AsyncGSM
+{
+ public:
+  AsyncGSM(uint8_t rst, uint8_t pstat, uint8_t key);
+  uint8_t initialize(Stream &serial);
+  void resetModemState();
+  void setDebugStream(Stream &debugStream);
+  void setEventCallback(GSMEventCallback callback, void * context = NULL);
+  void setBaudRate(uint32_t baud, uint32_t fallback, GSMBaudCallback callback, void * context = NULL);
+  uint32_t getBaudRate();
+#if GSM_TRACE_BUFFER_SIZE > 0
+  void dumpTrace(Stream &stream);
+#endif
+#if GSM_ENABLE_STATS
+  const GSMStats & getStats();
+  void resetStats();
+#endif
+  uint16_t process();
+  uint32_t timeUntilNextDeadline();
+  uint32_t nextWakeup();
+  void setRxBudget(uint16_t budget);
+  uint8_t queueAtCommand(GSMFlashStringPtr command, uint32_t timeout, GSMCommandCallback callback = NULL, void * context = NULL, uint8_t priority = GSM_PRIORITY_USER, uint8_t expected = MODEM_LINE_OK, GSMFlashStringPtr reply = NULL);
+  uint8_t queueAtCommand(const char * command, uint32_t timeout, GSMCommandCallback callback = NULL, void * context = NULL, uint8_t priority = GSM_PRIORITY_USER, uint8_t expected = MODEM_LINE_OK, GSMFlashStringPtr reply = NULL);
+  uint8_t commandQueueSize();
+  void setCommandSteps(const GSMCommandStep * steps, uint8_t count);
+  uint8_t isModemIdle();
+  uint8_t isModemError();
+  uint8_t isModemRegistered();
+  void enableGprs();
+  void disableGprs();
+  void enableQuickSend();
+  void disableQuickSend();
+  void enableTransparentMode();
+  void disableTransparentMode();
+  void holdCommandMode();
+  void releaseCommandMode();
+  uint8_t isDataMode();
+  void enableFlowControl(int8_t rtsPin = -1, int8_t ctsPin = -1);
+  void disableFlowControl();
+  void setQuickSendBudget(uint16_t bytes);
+  uint32_t sentBytes(int connection);
+  uint32_t acknowledgedBytes(int connection);
+  uint8_t getSignalQuality();
+  GSMBatteryStatus getBatteryStatus();
+  void suspendPolling();
+  void resumePolling();
+  void enablePowerSave();
+  void disablePowerSave();
+  uint8_t isGprsEnabled();
+  uint8_t isGprsDisabled();
+  void connect(char * ipaddress, int port, int connection, int type);
+  void disconnect(int connection);
+  uint8_t isConnected(int connection);
+  uint16_t writeData(char * data, int len, int connection);
+  uint16_t availableForWrite(int connection);
+  void setCoalescing(int connection, uint16_t minBytes, uint16_t maxHold);
+  void flush(int connection);
+#if GSM_ENABLE_SMS
+  uint8_t messageAvailable();
+  ShortMessage * peekMessage();
+  void popMessage();
+  uint16_t messageOverflowCount();
+#endif
+  uint16_t dataAvailable(int connection);
+  uint16_t readData(char * data, uint16_t maxLen, int connection);
+  uint16_t outboundBufferSize(int connection);
+#if GSM_ENABLE_SMS
+  ShortMessage readMessage();
+  uint8_t sendMessage(const ShortMessage & message, GSMMessageCallback callback = NULL, void * context = NULL);
+  uint8_t messageOutboxSize();
+#endif
+#if GSM_ENABLE_CLOCK
+  time_t getCurrentTime();
+  int32_t getClockDrift();
+#endif
+#if GSM_ENABLE_CALLS
+  int8_t incomingCall();
+  char * getCallerIdentification();
+  void answerIncomingCall();
+  void hangupCall();
+#endif
+  void setPower(uint8_t power);
+ protected:
+  uint8_t handlePowerState();
+  void processIncomingModemByte (const byte inByte);
+  void process_modem_data (const char * data);
+#if GSM_ENABLE_SMS
+  void smsBodyComplete();
+#endif
+  uint8_t classifyModemLine(const char * data);
+  uint8_t isCommandReply(const char * data, uint8_t line);
+  GSMFlashStringPtr ok_reply;
+  ConnectionState connectionState[GSM_MAX_CONNECTIONS];
+ private:  
+  template <uint16_t SIZE> uint8_t writeBuffer(CircularBuffer<SIZE> * buffer, char data);
+  template <uint16_t SIZE> uint8_t readBuffer(CircularBuffer<SIZE> * buffer, char * data);
+  template <uint16_t SIZE> uint16_t writeBuffer(CircularBuffer<SIZE> * buffer, const char * data, uint16_t len);
+  template <uint16_t SIZE> uint16_t readBuffer(CircularBuffer<SIZE> * buffer, char * data, uint16_t len);
+  template <uint16_t SIZE> uint16_t writableSpan(CircularBuffer<SIZE> * buffer, char ** data);
+  template <uint16_t SIZE> void commit(CircularBuffer<SIZE> * buffer, uint16_t len);
+  template <uint16_t SIZE> uint16_t readableSpan(CircularBuffer<SIZE> * buffer, char ** data);
+  template <uint16_t SIZE> void consume(CircularBuffer<SIZE> * buffer, uint16_t len);
+  template <uint16_t SIZE> uint16_t bufferSize(CircularBuffer<SIZE> * buffer);
+  int8_t parseConnectionNumber(const char * data);
+  void sendAtCommand(GSMFlashStringPtr command, uint32_t timeout);
+  void sendAtCommand(const char * command, uint32_t timeout);
+  uint8_t sendQueuedCommand(uint8_t maxPriority);
+  void completeCommand(uint8_t result, const char * reply);
+  void notify(uint8_t event, int8_t connection);
+  void setGprsState(int8_t state);
+  void closeAllConnections();
+  void setRegistration(int8_t state);
+  void sendComplete(int connection);
+  void setDataMode(int8_t mode);
+  uint8_t escapeNeeded();
+  uint8_t sendTransparentSetup();
+  uint16_t transferTransparent();
+  void receiveTransparent(char inByte);
+  void setReceiveHold(uint8_t hold);
+  uint8_t transmitPending();
+  uint8_t sendReady(int connection);
+  uint32_t modemConditions();
+  uint8_t sendCommandStep(uint32_t conditions);
+  void beginCommand(int8_t state);
+  uint8_t sendBaudRateCommand();
+  void switchBaudRate(uint32_t baud);
+  void setTimer(uint8_t timer, uint32_t delay);
+  void cancelTimer(uint8_t timer);
+  uint8_t timerDue(uint8_t timer);
+  void runTimers();
+  uint32_t pollInterval(uint32_t interval);
+#if GSM_ENABLE_SMS
+  void completeOutboundMessage(uint8_t status);
+#endif
+  Stream *mySerial;
+  Stream *debugStream;
+#if GSM_TRACE_BUFFER_SIZE > 0
+  void recordTrace(uint8_t event, uint16_t arg);
+  GSMTraceEvent traceBuffer[GSM_TRACE_BUFFER_SIZE];
+  uint16_t traceHead;
+  uint16_t traceCount;
+#endif
+#if GSM_ENABLE_STATS
+  GSMStats stats;
+#endif
+#if GSM_ENABLE_SMS || GSM_ENABLE_CLOCK
+  time_t parseTime(const char * timeString);
+#endif
+#if GSM_ENABLE_CLOCK
+  void updateNetworkTime(time_t networkTime);
+#endif
+  char input_modem_line [GSM_LINE_BUFFER_SIZE];
+  uint8_t input_modem_pos = 0;
+  uint16_t receive_remaining;
+  int8_t receive_connection;
+#if GSM_ENABLE_SMS
+  uint8_t sms_body_pending;
+#endif
+  AtCommand commandQueue[GSM_COMMAND_QUEUE_SIZE];
+  uint8_t commandQueueLength;
+  GSMCommandCallback command_callback;
+  GSMEventCallback event_callback;
+  void * event_context;
+  GSMBaudCallback baud_callback;
+  void * baud_context;
+  uint32_t baud_target;
+  uint32_t baud_fallback;
+  uint32_t baud_current;
+  int8_t baud_state;
+  uint8_t baud_failures;
+  void * command_context;
+  uint8_t command_expected;
+  GSMFlashStringPtr command_reply;
+  const GSMCommandStep * command_steps;
+  uint8_t command_step_count;
+  uint32_t step_conditions;  // modemConditions() at the last step scan
+  uint16_t rx_budget;
+  int8_t modem_state;
+  int8_t command_state;
+  int8_t autobauding;
+  int8_t cipmux;
+  int8_t cipqsend;
+  uint8_t enable_cipqsend : 1;
+  uint8_t enable_ifc : 1;
+  uint8_t receive_hold : 1;
+  uint8_t enable_cipmode : 1;
+  uint8_t command_hold : 1;
+  uint8_t enable_gprs : 1;
+  uint8_t enable_powersave : 1;
+  uint8_t powersave : 1;
+  uint8_t polling_suspended : 1;
+  uint8_t work_pending : 1;
+  uint8_t steps_idle : 1;  // the last step scan sent nothing and nothing changed since
+  uint16_t qsend_budget;
+  int8_t ifc;
+  int8_t rts_pin;
+  int8_t cts_pin;
+  int8_t cipmode;
+  int8_t data_mode;
+  uint8_t result_match;
+  uint8_t escape_attempts;
+  int8_t gprs_state;
+  int8_t gprs_active;
+  int8_t ip_address;
+  int8_t echo;
+#if GSM_ENABLE_SMS
+  int8_t cnmi;
+  int8_t cmgf;
+  int8_t cscs;
+#endif
+#if GSM_ENABLE_CLOCK
+  int8_t clts;
+#endif
+  int8_t creg;
+#if GSM_ENABLE_CALLS
+  int8_t clip;
+  int8_t incomingcall;
+  int8_t callinprogress;
+  int8_t answerincomingcall;
+  char callerId[14];
+#endif
+  int8_t currentconnection;
+  uint8_t next_send_connection;
+  uint32_t last_udp_send;
+  uint32_t last_command;
+#if GSM_ENABLE_SMS
+  ShortMessage inboundMessages[GSM_SMS_QUEUE_SIZE];
+  uint8_t inbound_message_head;
+  uint8_t inbound_message_count;
+  uint16_t inbound_message_overflow;
+  OutboundMessage outboundMessages[GSM_SMS_OUTBOX_SIZE];
+  uint8_t outbound_message_head;
+  uint8_t outbound_message_count;
+  uint8_t outbound_message_reference;
+  int8_t cmms;
+#endif
+#if GSM_ENABLE_CLOCK
+  time_t last_network_time;
+  uint32_t last_network_time_update;
+  time_t clock_reference_time;
+  uint32_t clock_reference_update;
+  int32_t clock_drift;
+  uint32_t cclk_interval;
+#endif
+  uint32_t csq_interval;
+  uint32_t cbc_interval;
+  uint8_t signal_quality;
+  GSMBatteryStatus battery;
+  int8_t creg_urc;
+  uint32_t timer_deadlines[GSM_TIMER_COUNT];
+  uint32_t next_deadline;
+  uint16_t timers_armed;
+  uint16_t timers_due;
+
+  // power status
+  uint8_t power_state;
+  uint8_t power;
+
+  // fona pins
+  uint8_t reset;
+  uint8_t pstat;
+  uint8_t key;
+};
+
+#ifdef GSM_RAM_BUDGET
+static_assert(sizeof(AsyncGSM) <= GSM_RAM_BUDGET, "AsyncGSM does not fit GSM_RAM_BUDGET, "
+	      "disable features or shrink the buffers");
+#endif
+
+#endif
@@ -0,0 +1,76 @@
+/*
+  Arduino.cpp
+*/
+
+#include "Arduino.h"
+
+static unsigned long long host_micros = 0;
+static uint8_t host_pins[256];
+
+uint32_t millis() {
+  return (uint32_t)(host_micros / 1000);
+}
+
+uint32_t micros() {
+  return (uint32_t)host_micros;
+}
+
+void hostAdvanceMicros(unsigned long us) {
+  host_micros += us;
+}
+
+unsigned long long hostMicros() {
+  return host_micros;
+}
+
+void pinMode(uint8_t, uint8_t) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  host_pins[pin] = value;
+}
+
+int digitalRead(uint8_t pin) {
+  return host_pins[pin];
+}
+
+void hostSetPin(uint8_t pin, uint8_t value) {
+  host_pins[pin] = value;
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (size--) {
+    n += write(*buffer++);
+  }
+  return n;
+}
+
+size_t Print::print(long n, int base) {
+  char text[24];
+  snprintf(text, sizeof(text), base == HEX ? "%lx" : "%ld", n);
+  return write(text);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  char text[24];
+  snprintf(text, sizeof(text), base == HEX ? "%lx" : "%lu", n);
+  return write(text);
+}
+
+size_t Print::print(double n, int digits) {
+  char text[32];
+  snprintf(text, sizeof(text), "%.*f", digits, n);
+  return write(text);
+}
+
+size_t Stream::readBytes(char *buffer, size_t length) {
+  size_t n = 0;
+  while (n < length) {
+    int c = read();
+    if (c < 0)
+      break;
+    buffer[n++] = c;
+  }
+  return n;
+}
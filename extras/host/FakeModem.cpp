@@ -0,0 +1,531 @@
+/*
+  FakeModem.cpp
+*/
+
+#include "FakeModem.h"
+
+static uint32_t bitTime(uint32_t baud) {
+  // 8N1: ten bits per byte
+  uint32_t micros = 10000000UL / baud;
+  return micros > 0 ? micros : 1;
+}
+
+FakeModem::FakeModem(uint32_t baud)
+{
+  this->baud = hostBaud = baud;
+  byteMicros = hostByteMicros = bitTime(baud);
+  maxBaud = 0;
+  resetPin = 0xFF;
+  rtsPin = 0xFF;
+  ctsPin = 0xFF;
+  rejectCommand = NULL;
+  inReset = 0;
+  lineFreeAt = 0;
+  commandLatency = 20000;
+  connectLatency = 500000;
+  gprsLatency = 2000000;
+  sendLatency = 300000;
+  rxFifoSize = 64;
+  commands = 0;
+  uplinkBytes = 0;
+  sends = 0;
+  sendsCompleted = 0;
+  smsSent = 0;
+  smsLinks = 0;
+  overrunBytes = 0;
+  garbledBytes = 0;
+  ctsViolations = 0;
+  rejected = 0;
+  held = 0;
+  heldSince = 0;
+  ctsFreeAt = 0;
+  echo = 1;
+  ifc = 0;
+  creg = 0;
+  cmgf = 0;
+  cmms = 0;
+  cnmi = "0,0,0,0,0";
+  smsLinkUntil = 0;
+  cipmux = 0;
+  cipqsend = 0;
+  cipmode = 0;
+  dataMode = 0;
+  escapeCount = 0;
+  escapeAt = 0;
+  lastDataAt = 0;
+  gprs = 0;
+  memset(connected, 0, sizeof(connected));
+  memset(txTotal, 0, sizeof(txTotal));
+  sendConnection = -1;
+  sendRemaining = 0;
+  sendLength = 0;
+  smsPrompt = 0;
+  smsReference = 0;
+  skipLf = 0;
+}
+
+// Queues bytes to be sent to the host after delay, serialized behind
+// everything already on the line
+void FakeModem::emit(const std::string &bytes, uint32_t delay) {
+  Output out;
+  out.start = hostMicros() + (unsigned long long)delay;
+  if (out.start < lineFreeAt)
+    out.start = lineFreeAt;
+  out.bytes = bytes;
+  out.delivered = 0;
+  out.byteMicros = byteMicros;
+  out.garbled = linkGarbled();
+  lineFreeAt = out.start + (unsigned long long)bytes.size() * byteMicros;
+  output.push_back(out);
+}
+
+void FakeModem::reply(const std::string &line, uint32_t delay) {
+  emit("\r\n" + line + "\r\n", delay);
+}
+
+// Returns 1 while the reset input is held low. The modem comes out of
+// reset autobauding with everything but the stored settings forgotten.
+uint8_t FakeModem::checkReset() {
+  if (resetPin == 0xFF)
+    return 0;
+  if (digitalRead(resetPin) == LOW) {
+    inReset = 1;
+    output.clear();
+    line.clear();
+    return 1;
+  }
+  if (inReset) {
+    inReset = 0;
+    // autobauding detects at most 115200
+    baud = hostBaud <= 115200 ? hostBaud : 115200;
+    byteMicros = bitTime(baud);
+    echo = 1;
+    ifc = 0;
+    held = 0;
+    creg = 0;
+    cmgf = 0;
+    cmms = 0;
+    cnmi = "0,0,0,0,0";
+    smsLinkUntil = 0;
+    cipmux = 0;
+    cipqsend = 0;
+    cipmode = 0;
+    dataMode = 0;
+    escapeCount = 0;
+    pendingData.clear();
+    gprs = 0;
+    memset(connected, 0, sizeof(connected));
+    sendRemaining = 0;
+    smsPrompt = 0;
+  }
+  return 0;
+}
+
+// Returns 1 while the host asks the modem to stop sending. The modem
+// only listens to RTS after AT+IFC=2,2.
+uint8_t FakeModem::receiveHeld() {
+  if (!ifc)
+    return 0;
+  if (rtsPin != 0xFF)
+    return digitalRead(rtsPin) == HIGH;
+  return rxFifoSize && fifo.size() >= rxFifoSize;
+}
+
+// Returns 1 while the modem asks the host to stop sending
+uint8_t FakeModem::ctsHeld() {
+  return ifc && hostMicros() < ctsFreeAt;
+}
+
+// Moves the bytes that have arrived by now into the host receive fifo
+void FakeModem::pump() {
+  if (checkReset())
+    return;
+  unsigned long long now = hostMicros();
+  if (ctsPin != 0xFF)
+    hostSetPin(ctsPin, ctsHeld() ? HIGH : LOW);
+  if (held) {
+    if (receiveHeld())
+      return;
+    // everything still queued goes out that much later
+    held = 0;
+    for (size_t i = 0; i < output.size(); i++)
+      output[i].start += now - heldSince;
+    lineFreeAt += now - heldSince;
+  }
+  if (escapeCount == 3 && now >= escapeAt) {
+    // +++ with a guard second on both sides, back to command mode
+    escapeCount = 0;
+    dataMode = 0;
+    reply("OK", 0);
+  }
+  while (!output.empty()) {
+    Output &out = output.front();
+    if (now < out.start)
+      return;
+    size_t arrived = (now - out.start) / out.byteMicros;
+    if (arrived > out.bytes.size())
+      arrived = out.bytes.size();
+    while (out.delivered < arrived) {
+      if (receiveHeld()) {
+	// the line stops when this byte would have arrived
+	held = 1;
+	heldSince = out.start + (unsigned long long)(out.delivered + 1) * out.byteMicros;
+	return;
+      }
+      if (out.garbled) {
+	garbledBytes++;
+      } else if (rxFifoSize && fifo.size() >= rxFifoSize) {
+	overrunBytes++;
+      } else {
+	fifo.push_back(out.bytes[out.delivered]);
+      }
+      out.delivered++;
+    }
+    if (out.delivered < out.bytes.size())
+      return;
+    output.pop_front();
+  }
+}
+
+int FakeModem::available() {
+  pump();
+  return fifo.size();
+}
+
+int FakeModem::read() {
+  pump();
+  if (fifo.empty())
+    return -1;
+  int c = (uint8_t)fifo.front();
+  fifo.pop_front();
+  return c;
+}
+
+int FakeModem::peek() {
+  pump();
+  return fifo.empty() ? -1 : (uint8_t)fifo.front();
+}
+
+int FakeModem::availableForWrite() {
+  return 64;
+}
+
+size_t FakeModem::write(const uint8_t *buffer, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    write(buffer[i]);
+  }
+  return size;
+}
+
+// The host UART was switched to another rate
+void FakeModem::setHostBaud(uint32_t baud) {
+  hostBaud = baud;
+  hostByteMicros = bitTime(baud);
+}
+
+// Nothing gets through when the two ends disagree on the rate or the
+// rate is too high for the wiring
+uint8_t FakeModem::linkGarbled() {
+  return hostBaud != baud || (maxBaud && baud > maxBaud);
+}
+
+// The host blocks on its transmit line for one byte time per byte
+size_t FakeModem::write(uint8_t c) {
+  if (ctsPin == 0xFF && ctsHeld()) {
+    // the host uart waits for CTS
+    hostAdvanceMicros(ctsFreeAt - hostMicros());
+  }
+  hostAdvanceMicros(hostByteMicros);
+
+  if (checkReset())
+    return 1;
+  if (linkGarbled()) {
+    garbledBytes++;
+    return 1;
+  }
+
+  if (c == '\n' && skipLf) {
+    // line feed terminating the previous command
+    skipLf = 0;
+    return 1;
+  }
+  skipLf = 0;
+
+  if (dataMode) {
+    handleData(c);
+    return 1;
+  }
+
+  if (sendRemaining > 0 || smsPrompt) {
+    handlePayload(c);
+    return 1;
+  }
+
+  if (c == '\r') {
+    if (echo)
+      emit(line + "\r", 0);
+    skipLf = 1;
+    if (line.size() > 0)
+      handleCommand(line);
+    line.clear();
+  } else if (c != '\n') {
+    line += (char)c;
+  }
+  return 1;
+}
+
+void FakeModem::handlePayload(uint8_t c) {
+  if (smsPrompt) {
+    if (c == 0x1A) {
+      smsPrompt = 0;
+      smsSent++;
+      uint32_t latency = sendLatency;
+      if (hostMicros() >= smsLinkUntil) {
+	// the relay link has to be set up first
+	smsLinks++;
+	latency += connectLatency;
+      }
+      reply("+CMGS: " + std::to_string(++smsReference), latency);
+      reply("OK", 0);
+      // with AT+CMMS the link stays up for a few seconds after the result
+      smsLinkUntil = cmms ? lineFreeAt + 5000000ULL : 0;
+      if (cmms == 1)
+	cmms = 0;
+    } else if (c == 0x1B) {
+      smsPrompt = 0;
+      reply("OK", commandLatency);
+    }
+    return;
+  }
+
+  uplinkBytes++;
+  txTotal[sendConnection]++;
+  if (--sendRemaining == 0) {
+    sendsCompleted++;
+    std::string n = std::to_string(sendConnection);
+    if (cipqsend) {
+      reply("DATA ACCEPT:" + n + "," + std::to_string(sendLength), commandLatency);
+    } else {
+      reply(n + ", SEND OK", sendLatency);
+    }
+  }
+}
+
+// Transparent mode: everything is payload except a +++ surrounded by a
+// second of silence
+void FakeModem::handleData(uint8_t c) {
+  unsigned long long now = hostMicros();
+  if (c == '+' && escapeCount < 3 && (escapeCount > 0 || now - lastDataAt >= 1000000ULL)) {
+    if (++escapeCount == 3)
+      escapeAt = now + 1000000ULL;
+  } else {
+    // held back + were payload after all
+    uplinkBytes += escapeCount + 1;
+    txTotal[0] += escapeCount + 1;
+    escapeCount = 0;
+  }
+  lastDataAt = now;
+}
+
+static uint8_t startsWith(const std::string &s, const char * prefix) {
+  return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// AT+X=<n> with n from 0 to max
+void FakeModem::settingCommand(const std::string &command, size_t pos, uint8_t max, uint8_t * setting) {
+  if (command.size() != pos + 1 || command[pos] < '0' || command[pos] > '0' + max) {
+    reply("ERROR", commandLatency);
+    return;
+  }
+  *setting = command[pos] - '0';
+  reply("OK", commandLatency);
+}
+
+void FakeModem::handleCommand(const std::string &command) {
+  commands++;
+
+  if (rejectCommand && startsWith(command, rejectCommand)) {
+    rejected++;
+    reply("ERROR", commandLatency);
+    return;
+  }
+
+  if (command == "ATE0") {
+    echo = 0;
+    reply("OK", commandLatency);
+  } else if (command == "ATE1") {
+    echo = 1;
+    reply("OK", commandLatency);
+  } else if (startsWith(command, "AT+CSQ")) {
+    reply("+CSQ: 18,0", commandLatency);
+    reply("OK", 0);
+  } else if (startsWith(command, "AT+CBC")) {
+    reply("+CBC: 0,80,4000", commandLatency);
+    reply("OK", 0);
+  } else if (command == "AT+CREG?") {
+    reply("+CREG: " + std::to_string(creg) + ",1", commandLatency);
+    reply("OK", 0);
+  } else if (startsWith(command, "AT+CREG=")) {
+    settingCommand(command, 8, 2, &creg);
+  } else if (command == "AT+CCLK?") {
+    reply("+CCLK: \"26/10/17,12:00:00+12\"", commandLatency);
+    reply("OK", 0);
+  } else if (command == "AT+CNMI?") {
+    reply("+CNMI: " + cnmi, commandLatency);
+    reply("OK", 0);
+  } else if (startsWith(command, "AT+CNMI=")) {
+    cnmi = command.substr(8);
+    reply("OK", commandLatency);
+  } else if (command == "AT+CMGF?") {
+    reply("+CMGF: " + std::to_string(cmgf), commandLatency);
+    reply("OK", 0);
+  } else if (startsWith(command, "AT+CMGF=")) {
+    settingCommand(command, 8, 1, &cmgf);
+  } else if (startsWith(command, "AT+CMMS=")) {
+    settingCommand(command, 8, 2, &cmms);
+  } else if (command == "AT+IFC=2,2") {
+    ifc = 1;
+    reply("OK", commandLatency);
+  } else if (command == "AT+IFC=0,0") {
+    ifc = 0;
+    reply("OK", commandLatency);
+  } else if (startsWith(command, "AT+IFC")) {
+    // other combinations are not used
+    reply("ERROR", commandLatency);
+  } else if (command == "AT+CIPMUX?") {
+    reply(std::string("+CIPMUX: ") + (cipmux ? "1" : "0"), commandLatency);
+    reply("OK", 0);
+  } else if (startsWith(command, "AT+CIPMUX=")) {
+    cipmux = command[10] == '1';
+    reply("OK", commandLatency);
+  } else if (startsWith(command, "AT+CIPMODE=")) {
+    cipmode = command[11] == '1';
+    reply("OK", commandLatency);
+  } else if (command == "ATO") {
+    if (cipmode && connected[0]) {
+      reply("CONNECT", commandLatency);
+      dataMode = 1;
+      lastDataAt = hostMicros();
+      if (pendingData.size() > 0) {
+	emit(pendingData, 0);
+	pendingData.clear();
+      }
+    } else {
+      reply("NO CARRIER", commandLatency);
+    }
+  } else if (startsWith(command, "AT+CIPQSEND=")) {
+    cipqsend = command[12] == '1';
+    reply("OK", commandLatency);
+  } else if (command == "AT+CIPSHUT") {
+    gprs = 0;
+    memset(connected, 0, sizeof(connected));
+    pendingData.clear();
+    reply("SHUT OK", commandLatency);
+  } else if (startsWith(command, "AT+CIICR")) {
+    gprs = 1;
+    reply("OK", gprsLatency);
+  } else if (command == "AT+CIFSR") {
+    reply("10.0.0.2", commandLatency);
+  } else if (startsWith(command, "AT+CIPSTART=")) {
+    uint8_t n = cipmux ? command[12] - '0' : 0;
+    connected[n] = 1;
+    txTotal[n] = 0;
+    reply("OK", commandLatency);
+    if (cipmode) {
+      reply("CONNECT", connectLatency);
+      dataMode = 1;
+      lastDataAt = hostMicros();
+    } else {
+      reply((cipmux ? std::to_string(n) + ", " : std::string()) + "CONNECT OK", connectLatency);
+    }
+  } else if (startsWith(command, "AT+CIPCLOSE")) {
+    uint8_t n = cipmux ? command[12] - '0' : 0;
+    connected[n] = 0;
+    reply((cipmux ? std::to_string(n) + ", " : std::string()) + "CLOSE OK", commandLatency);
+  } else if (startsWith(command, "AT+CIPSEND=")) {
+    if (ctsHeld())
+      ctsViolations++;
+    sendConnection = command[11] - '0';
+    sendLength = sendRemaining = atoi(command.c_str() + 13);
+    sends++;
+    emit("\r\n> ", commandLatency);
+  } else if (startsWith(command, "AT+CIPACK=")) {
+    uint8_t n = command[10] - '0';
+    std::string tx = std::to_string(txTotal[n]);
+    reply("+CIPACK: " + tx + "," + tx + ",0", commandLatency);
+    reply("OK", 0);
+  } else if (startsWith(command, "AT+IPR=")) {
+    uint32_t rate = atol(command.c_str() + 7);
+    if (rate == 0 || rate > 460800) {
+      reply("ERROR", commandLatency);
+    } else {
+      // the OK still goes out at the old rate
+      reply("OK", commandLatency);
+      baud = rate;
+      byteMicros = bitTime(rate);
+    }
+  } else if (startsWith(command, "AT+CMGS=")) {
+    if (cmgf != 1) {
+      // the library only sends text mode messages
+      reply("+CMS ERROR: 304", commandLatency);
+      return;
+    }
+    smsPrompt = 1;
+    emit("\r\n> ", commandLatency);
+  } else if (startsWith(command, "AT")) {
+    reply("OK", commandLatency);
+  } else {
+    reply("ERROR", commandLatency);
+  }
+}
+
+void FakeModem::injectUrc(const char * line) {
+  reply(line, 0);
+}
+
+void FakeModem::injectReceive(uint8_t connection, const char * data, uint16_t len) {
+  if (cipmode) {
+    // no framing in transparent mode, in command mode the data waits for ATO
+    if (dataMode)
+      emit(std::string(data, len), 0);
+    else
+      pendingData.append(data, len);
+    return;
+  }
+  emit("\r\n+RECEIVE," + std::to_string(connection) + "," + std::to_string(len) + ":\r\n" + std::string(data, len), 0);
+}
+
+// The remote end closes the connection
+void FakeModem::injectClose(uint8_t connection) {
+  connected[connection] = 0;
+  pendingData.clear();
+  if (dataMode) {
+    dataMode = 0;
+    reply("CLOSED", 0);
+  } else {
+    reply((cipmux ? std::to_string(connection) + ", " : std::string()) + "CLOSED", 0);
+  }
+}
+
+// A text message arrives from the network. Only AT+CNMI=2,2 routes it
+// straight to the host.
+void FakeModem::injectMessage(const char * number, const char * text) {
+  if (cmgf != 1 || !startsWith(cnmi, "2,2")) {
+    reply("+CMTI: \"SM\",1", 0);
+    return;
+  }
+  emit(std::string("\r\n+CMT: \"") + number + "\",\"\",\"26/10/17,12:00:00+12\"\r\n" + text + "\r\n", 0);
+}
+
+// The modem raises CTS for a while, the host must not start a CIPSEND
+void FakeModem::holdCts(uint32_t us) {
+  ctsFreeAt = hostMicros() + (unsigned long long)us;
+  if (ctsPin != 0xFF)
+    hostSetPin(ctsPin, ctsHeld() ? HIGH : LOW);
+}
+
+// Returns 1 when everything the modem had to say has reached the host
+uint8_t FakeModem::isIdle() {
+  pump();
+  return output.empty();
+}
@@ -0,0 +1,140 @@
+/*
+  FakeModem.h
+
+  In-process SIM800 stand-in for host builds. It answers the AT dialogue
+  AsyncGSM uses, delivers its output at the configured baud rate through
+  a bounded receive FIFO like a hardware UART, and charges the simulated
+  clock for every byte the library writes. Settings the library relies
+  on (AT+IFC, AT+CREG, AT+CMGF, AT+CNMI, AT+CMMS) are modelled, any other
+  AT command is answered with OK unless the script makes the modem refuse
+  it.
+*/
+#ifndef FakeModem_h
+#define FakeModem_h
+
+#include "Arduino.h"
+#include <deque>
+#include <string>
+
+class FakeModem : public Stream
+{
+ public:
+  FakeModem(uint32_t baud);
+
+  // Stream
+  int available();
+  int read();
+  int peek();
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buffer, size_t size);
+  int availableForWrite();
+
+  // scripting
+  void injectUrc(const char * line);
+  void injectReceive(uint8_t connection, const char * data, uint16_t len);
+  void injectClose(uint8_t connection);
+  void injectMessage(const char * number, const char * text);
+  void holdCts(uint32_t us);
+  uint8_t isIdle();
+  void setHostBaud(uint32_t baud);
+
+  // latencies in microseconds
+  uint32_t commandLatency;
+  uint32_t connectLatency;
+  uint32_t gprsLatency;
+  uint32_t sendLatency;
+
+  // bytes the host UART can hold before the modem output overruns, 0 = unlimited
+  uint16_t rxFifoSize;
+
+  // highest rate the wiring carries, every byte above it is corrupted, 0 = no limit
+  uint32_t maxBaud;
+
+  // host pin wired to the modem reset input, active low, 0xFF = not wired
+  uint8_t resetPin;
+
+  // host pin driving the modem RTS input, 0xFF = the host uart raises RTS
+  // itself when its fifo is full
+  uint8_t rtsPin;
+
+  // commands starting with this are answered with ERROR, NULL = none
+  const char * rejectCommand;
+
+  // host pin reading the modem CTS output, 0xFF = the host uart stops
+  // sending by itself while CTS is high
+  uint8_t ctsPin;
+
+  // statistics
+  uint32_t commands;
+  uint32_t uplinkBytes;
+  uint32_t sends;
+  uint32_t sendsCompleted;
+  uint32_t smsSent;
+  uint32_t smsLinks;
+  uint32_t overrunBytes;
+  uint32_t garbledBytes;
+  uint32_t ctsViolations;
+  uint32_t rejected;
+
+ private:
+  struct Output {
+    unsigned long long start;
+    std::string bytes;
+    size_t delivered;
+    uint32_t byteMicros;
+    uint8_t garbled;
+  };
+
+  void emit(const std::string &bytes, uint32_t delay);
+  void reply(const std::string &line, uint32_t delay);
+  void pump();
+  void handleCommand(const std::string &command);
+  void settingCommand(const std::string &command, size_t pos, uint8_t max, uint8_t * setting);
+  void handlePayload(uint8_t c);
+  void handleData(uint8_t c);
+  uint8_t linkGarbled();
+  uint8_t checkReset();
+  uint8_t receiveHeld();
+  uint8_t ctsHeld();
+
+  uint32_t baud;
+  uint32_t hostBaud;
+  uint32_t byteMicros;
+  uint32_t hostByteMicros;
+  unsigned long long lineFreeAt;
+  std::deque<Output> output;
+  std::deque<char> fifo;
+  std::string line;
+  std::string pendingData;
+  uint8_t held;
+  unsigned long long heldSince;
+  unsigned long long ctsFreeAt;
+
+  uint8_t echo;
+  uint8_t ifc;
+  uint8_t creg;
+  uint8_t cmgf;
+  uint8_t cmms;
+  std::string cnmi;
+  unsigned long long smsLinkUntil;
+  uint8_t cipmux;
+  uint8_t cipqsend;
+  uint8_t cipmode;
+  uint8_t dataMode;
+  uint8_t escapeCount;
+  unsigned long long escapeAt;
+  unsigned long long lastDataAt;
+  uint8_t gprs;
+  uint8_t connected[6];
+  uint32_t txTotal[6];
+
+  int8_t sendConnection;
+  uint16_t sendRemaining;
+  uint16_t sendLength;
+  uint8_t smsPrompt;
+  uint16_t smsReference;
+  uint8_t skipLf;
+  uint8_t inReset;
+};
+
+#endif
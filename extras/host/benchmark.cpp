@@ -0,0 +1,748 @@
+/*
+  benchmark.cpp
+
+  Runs AsyncGSM against FakeModem on simulated time and reports
+  time-to-GPRS-ready, uplink and downlink throughput and command rate.
+  Every scenario also checks that no data was lost and every send and
+  command completed; the exit status is 1 if any check failed.
+
+  usage: gsm_benchmark [baud] [command latency ms] [send latency ms]
+*/
+
+#include <time.h>
+#include "Arduino.h"
+#include "FakeModem.h"
+#include "AsyncGSM.h"
+
+#define PIN_RESET 2
+#define PIN_PSTAT 3
+#define PIN_KEY 4
+#define PIN_RTS 8
+#define PIN_CTS 9
+
+// simulated time between two process() calls of the host main loop
+#define LOOP_MICROS 100
+
+// longest a scenario waits for queued work to finish, ms
+#define DRAIN_TIMEOUT 60000UL
+
+static uint32_t baud = 115200;
+static uint32_t commandLatency = 20;
+static uint32_t sendLatency = 300;
+
+static double hostSeconds;
+static unsigned long processCalls;
+static unsigned failures;
+
+typedef struct {
+  double rate;
+  uint32_t injected;
+  uint32_t received;
+  uint32_t overrun;
+} Downlink;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(uint8_t ok, const char * what) {
+  if (!ok) {
+    printf("  FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+static FakeModem * createModem() {
+  FakeModem * modem = new FakeModem(baud);
+  modem->commandLatency = commandLatency * 1000;
+  modem->sendLatency = sendLatency * 1000;
+  return modem;
+}
+
+static AsyncGSM * createGsm(FakeModem * modem) {
+  hostSetPin(PIN_PSTAT, HIGH);
+  hostSetPin(PIN_RESET, HIGH);
+  AsyncGSM * gsm = new AsyncGSM(PIN_RESET, PIN_PSTAT, PIN_KEY);
+  gsm->initialize(*modem);
+  gsm->setPower(1);
+  return gsm;
+}
+
+static void destroyGsm(AsyncGSM * gsm) {
+  delete gsm;
+}
+
+static void step(AsyncGSM * gsm) {
+  double start = now();
+  gsm->process();
+  hostSeconds += now() - start;
+  processCalls++;
+  hostAdvanceMicros(LOOP_MICROS);
+}
+
+// Runs until GPRS is up and connection 0 is open, returns simulated ms
+static uint32_t bringUp(AsyncGSM * gsm, uint8_t connect) {
+  uint32_t start = millis();
+  gsm->enableGprs();
+  if (connect)
+    gsm->connect((char *)"10.0.0.1", 5000, 0, CONNECTION_TYPE_TCP);
+  while (!gsm->isGprsEnabled() || (connect && !gsm->isConnected(0))) {
+    step(gsm);
+    if (millis() - start > 600000UL) {
+      printf("bring-up did not complete\n");
+      exit(1);
+    }
+  }
+  return millis() - start;
+}
+
+static uint8_t uplinkIdle(FakeModem * modem, AsyncGSM * gsm) {
+  for (uint8_t i = 0; i < GSM_MAX_CONNECTIONS; i++) {
+    if (gsm->outboundBufferSize(i) > 0)
+      return 0;
+  }
+  return modem->isIdle();
+}
+
+// Runs until everything written has reached the modem, then checks that
+// no byte went missing and every CIPSEND was completed
+static void checkUplink(FakeModem * modem, AsyncGSM * gsm, uint32_t startBytes, uint32_t written) {
+  uint32_t start = millis();
+  while (!uplinkIdle(modem, gsm) && millis() - start < DRAIN_TIMEOUT)
+    step(gsm);
+  check(modem->uplinkBytes - startBytes == written, "uplink bytes lost");
+  check(modem->sends == modem->sendsCompleted, "cipsend left incomplete");
+}
+
+#if GSM_ENABLE_STATS
+// Prints "command issued timeouts errors latency histogram" for every command used
+static void printStats(AsyncGSM * gsm) {
+  const GSMStats & stats = gsm->getStats();
+  for (uint8_t i = 0; i < GSM_COMMAND_COUNT; i++) {
+    const GSMCommandStats * command = &stats.commands[i];
+    if (command->issued == 0)
+      continue;
+    printf("  command %2u: %5u %3u %3u |", i, command->issued, command->timeouts, command->errors);
+    for (uint8_t j = 0; j < GSM_STATS_BUCKETS; j++)
+      printf(" %u", command->latency[j]);
+    printf("\n");
+  }
+}
+#endif
+
+static void benchmarkBringUp() {
+  FakeModem * modem = createModem();
+  AsyncGSM * gsm = createGsm(modem);
+  uint32_t ms = bringUp(gsm, 0);
+  printf("time to gprs ready:  %10.3f s (%lu commands)\n", ms / 1000.0, (unsigned long)modem->commands);
+#if GSM_ENABLE_STATS
+  printStats(gsm);
+#endif
+  destroyGsm(gsm);
+  delete modem;
+}
+
+static void benchmarkUplink(uint32_t seconds, uint8_t quickSend) {
+  FakeModem * modem = createModem();
+  AsyncGSM * gsm = createGsm(modem);
+  if (quickSend)
+    gsm->enableQuickSend();
+  bringUp(gsm, 1);
+
+  char chunk[64];
+  memset(chunk, 'u', sizeof(chunk));
+  uint32_t startBytes = modem->uplinkBytes;
+  uint32_t written = 0;
+  uint32_t start = millis();
+  while (millis() - start < seconds * 1000UL) {
+    // keep the outbound buffer full
+    uint16_t space = gsm->availableForWrite(0);
+    if (space > sizeof(chunk))
+      space = sizeof(chunk);
+    if (space > 0)
+      written += gsm->writeData(chunk, space, 0);
+    step(gsm);
+  }
+  double elapsed = (millis() - start) / 1000.0;
+  printf(quickSend ? "uplink, quick send:  %10.0f bytes/s\n" : "uplink:              %10.0f bytes/s\n",
+	 (modem->uplinkBytes - startBytes) / elapsed);
+  checkUplink(modem, gsm, startBytes, written);
+  destroyGsm(gsm);
+  delete modem;
+}
+
+static uint32_t readAll(AsyncGSM * gsm) {
+  char buffer[256];
+  uint32_t received = 0;
+  for (uint8_t i = 0; i < GSM_MAX_CONNECTIONS; i++) {
+    uint16_t n;
+    while ((n = gsm->readData(buffer, sizeof(buffer), i)) > 0)
+      received += n;
+  }
+  return received;
+}
+
+// Streams segment sized +RECEIVEs round robin on the first connections,
+// read by an application that empties the buffers every readInterval ms,
+// then reads until the modem has nothing left to deliver
+static Downlink measureDownlink(FakeModem * modem, AsyncGSM * gsm, uint32_t seconds, uint16_t segment,
+				uint8_t connections, uint32_t readInterval) {
+  char * payload = new char[segment];
+  memset(payload, 'd', segment);
+  Downlink result;
+  result.injected = 0;
+  result.received = 0;
+  uint32_t overrun = modem->overrunBytes;
+  uint8_t next = 0;
+  uint32_t start = millis();
+  uint32_t lastRead = start;
+  while (millis() - start < seconds * 1000UL) {
+    // the network keeps the modem output busy
+    if (modem->isIdle()) {
+      modem->injectReceive(next, payload, segment);
+      result.injected += segment;
+      next = (next + 1) % connections;
+    }
+    step(gsm);
+    if (millis() - lastRead >= readInterval) {
+      result.received += readAll(gsm);
+      lastRead = millis();
+    }
+  }
+  result.rate = result.received / ((millis() - start) / 1000.0);
+
+  start = millis();
+  while (millis() - start < DRAIN_TIMEOUT) {
+    step(gsm);
+    uint32_t n = readAll(gsm);
+    result.received += n;
+    if (n == 0 && modem->isIdle() && modem->available() == 0)
+      break;
+  }
+  result.overrun = modem->overrunBytes - overrun;
+  delete[] payload;
+  return result;
+}
+
+static void checkDownlink(const Downlink & downlink) {
+  check(downlink.received == downlink.injected, "downlink bytes lost");
+  check(downlink.overrun == 0, "uart overrun");
+}
+
+static void benchmarkDownlink(uint32_t seconds, uint16_t segment) {
+  FakeModem * modem = createModem();
+  AsyncGSM * gsm = createGsm(modem);
+  bringUp(gsm, 1);
+
+  Downlink downlink = measureDownlink(modem, gsm, seconds, segment, 1, 0);
+  printf("downlink:            %10.0f bytes/s (%lu bytes lost to uart overrun)\n", downlink.rate, (unsigned long)downlink.overrun);
+  checkDownlink(downlink);
+  destroyGsm(gsm);
+  delete modem;
+}
+
+static uint32_t eventBytes;
+
+static void readOnEvent(void * context, uint8_t event, int8_t connection) {
+  if (event != GSM_NOTIFY_DATA)
+    return;
+  char buffer[256];
+  uint16_t n;
+  while ((n = ((AsyncGSM *)context)->readData(buffer, sizeof(buffer), connection)) > 0)
+    eventBytes += n;
+}
+
+// An application that only reads when GSM_NOTIFY_DATA tells it to, while
+// +RECEIVEs eight times the size of the inbound buffer stream in
+static void benchmarkEventReader(uint32_t seconds, uint8_t flowControl) {
+  FakeModem * modem = createModem();
+  AsyncGSM * gsm = createGsm(modem);
+  gsm->setEventCallback(readOnEvent, gsm);
+  if (flowControl)
+    gsm->enableFlowControl();
+  bringUp(gsm, 1);
+
+  char payload[GSM_RX_BUFFER_SIZE * 8];
+  memset(payload, 'd', sizeof(payload));
+  uint32_t injected = 0;
+  eventBytes = 0;
+  uint32_t start = millis();
+  while (millis() - start < seconds * 1000UL) {
+    if (modem->isIdle()) {
+      modem->injectReceive(0, payload, sizeof(payload));
+      injected += sizeof(payload);
+    }
+    step(gsm);
+  }
+  double rate = eventBytes / ((millis() - start) / 1000.0);
+  start = millis();
+  while (eventBytes < injected && millis() - start < DRAIN_TIMEOUT)
+    step(gsm);
+  printf("event reader, %-4s   %10.0f bytes/s down (%lu bytes lost)\n", flowControl ? "rts" : "off",
+	 rate, (unsigned long)(injected - eventBytes));
+  check(eventBytes == injected, "downlink bytes lost");
+  destroyGsm(gsm);
+  delete modem;
+}
+
+#if GSM_MAX_CONNECTIONS > 1
+// Uplink on every connection at once, then downlink spread over all of them
+static void benchmarkConnections(uint32_t seconds) {
+  FakeModem * modem = createModem();
+  AsyncGSM * gsm = createGsm(modem);
+  bringUp(gsm, 1);
+  for (uint8_t i = 1; i < GSM_MAX_CONNECTIONS; i++)
+    gsm->connect((char *)"10.0.0.1", 5000 + i, i, CONNECTION_TYPE_TCP);
+  uint32_t start = millis();
+  for (uint8_t i = 1; i < GSM_MAX_CONNECTIONS; i++) {
+    while (!gsm->isConnected(i) && millis() - start < DRAIN_TIMEOUT)
+      step(gsm);
+  }
+
+  char chunk[64];
+  memset(chunk, 'u', sizeof(chunk));
+  uint32_t startBytes = modem->uplinkBytes;
+  uint32_t written = 0;
+  start = millis();
+  while (millis() - start < seconds * 1000UL) {
+    for (uint8_t i = 0; i < GSM_MAX_CONNECTIONS; i++) {
+      uint16_t space = gsm->availableForWrite(i);
+      if (space > sizeof(chunk))
+	space = sizeof(chunk);
+      if (space > 0)
+	written += gsm->writeData(chunk, space, i);
+    }
+    step(gsm);
+  }
+  double uplink = (modem->uplinkBytes - startBytes) / ((millis() - start) / 1000.0);
+  checkUplink(modem, gsm, startBytes, written);
+
+  Downlink downlink = measureDownlink(modem, gsm, seconds, 1024, GSM_MAX_CONNECTIONS, 0);
+  printf("%u connections:       %10.0f bytes/s up, %.0f bytes/s down\n", GSM_MAX_CONNECTIONS, uplink, downlink.rate);
+  checkDownlink(downlink);
+  destroyGsm(gsm);
+  delete modem;
+}
+#endif
+
+// Keeps the outbound buffer of connection 0 full for seconds, returns the
+// number of bytes written
+static uint32_t fillUplink(AsyncGSM * gsm, uint32_t seconds) {
+  char chunk[64];
+  memset(chunk, 'u', sizeof(chunk));
+  uint32_t written = 0;
+  uint32_t start = millis();
+  while (millis() - start < seconds * 1000UL) {
+    uint16_t space = gsm->availableForWrite(0);
+    if (space > sizeof(chunk))
+      space = sizeof(chunk);
+    if (space > 0)
+      written += gsm->writeData(chunk, space, 0);
+    step(gsm);
+  }
+  return written;
+}
+
+// Quick send on a modem that refuses AT+CIPQSEND, then on one that
+// refuses AT+CIPACK for a while. Neither may leave the driver in the
+// error state or lose data.
+static void benchmarkErrors(uint32_t seconds) {
+  FakeModem * modem = createModem();
+  modem->rejectCommand = "AT+CIPQSEND";
+  AsyncGSM * gsm = createGsm(modem);
+  gsm->enableQuickSend();
+  bringUp(gsm, 1);
+  uint32_t startBytes = modem->uplinkBytes;
+  uint32_t written = fillUplink(gsm, seconds);
+  double refused = (modem->uplinkBytes - startBytes) / (double)seconds;
+  checkUplink(modem, gsm, startBytes, written);
+  check(!gsm->isModemError(), "modem error after a refused cipqsend");
+
+  modem->rejectCommand = "AT+CIPACK";
+  gsm->enableQuickSend();
+  startBytes = modem->uplinkBytes;
+  written = fillUplink(gsm, seconds);
+  check(!gsm->isModemError(), "modem error after a refused cipack");
+  modem->rejectCommand = NULL;
+  checkUplink(modem, gsm, startBytes, written);
+  uint32_t start = millis();
+  while (gsm->acknowledgedBytes(0) != gsm->sentBytes(0) && millis() - start < DRAIN_TIMEOUT)
+    step(gsm);
+  printf("refused commands:    %10.0f bytes/s up without cipqsend (%lu refused)\n", refused, (unsigned long)modem->rejected);
+  check(gsm->acknowledgedBytes(0) == gsm->sentBytes(0), "quick sent bytes never acknowledged");
+  destroyGsm(gsm);
+  delete modem;
+}
+
+static uint32_t modeSwitches;
+
+static void countModeSwitches(void *, uint8_t event, int8_t) {
+  if (event == GSM_NOTIFY_DATA_MODE || event == GSM_NOTIFY_COMMAND_MODE)
+    modeSwitches++;
+}
+
+// Uplink and downlink throughput of connection 0 in transparent mode,
+// with the regular housekeeping polls escaping to command mode
+static void benchmarkTransparent(uint32_t seconds) {
+  FakeModem * modem = createModem();
+  AsyncGSM * gsm = createGsm(modem);
+  gsm->setEventCallback(countModeSwitches);
+  gsm->enableTransparentMode();
+  bringUp(gsm, 1);
+  modeSwitches = 0;
+
+  char chunk[64];
+  memset(chunk, 'u', sizeof(chunk));
+  uint32_t startBytes = modem->uplinkBytes;
+  uint32_t written = 0;
+  uint32_t start = millis();
+  while (millis() - start < seconds * 1000UL) {
+    uint16_t space = gsm->availableForWrite(0);
+    if (space > sizeof(chunk))
+      space = sizeof(chunk);
+    if (space > 0)
+      written += gsm->writeData(chunk, space, 0);
+    step(gsm);
+  }
+  double uplink = (modem->uplinkBytes - startBytes) / ((millis() - start) / 1000.0);
+  checkUplink(modem, gsm, startBytes, written);
+
+  char payload[1024];
+  memset(payload, 'd', sizeof(payload));
+  uint32_t injected = 0;
+  uint32_t received = 0;
+  start = millis();
+  while (millis() - start < seconds * 1000UL) {
+    if (modem->isIdle() && gsm->isDataMode()) {
+      modem->injectReceive(0, payload, sizeof(payload));
+      injected += sizeof(payload);
+    }
+    step(gsm);
+    received += readAll(gsm);
+  }
+  double downlink = received / ((millis() - start) / 1000.0);
+  // data that came in command mode follows the next ATO
+  start = millis();
+  while (received < injected && millis() - start < DRAIN_TIMEOUT) {
+    step(gsm);
+    received += readAll(gsm);
+  }
+  printf("transparent:         %10.0f bytes/s up, %.0f bytes/s down (%lu mode switches)\n",
+	 uplink, downlink, (unsigned long)modeSwitches);
+  check(received == injected, "downlink bytes lost");
+  destroyGsm(gsm);
+  delete modem;
+}
+
+static void setHostBaud(void * context, uint32_t rate) {
+  ((FakeModem *)context)->setHostBaud(rate);
+}
+
+// Bring-up with an AT+IPR switch to target over wiring that carries at
+// most maxBaud, then downlink throughput at whatever rate was settled on
+static void benchmarkBaudRate(uint32_t target, uint32_t maxBaud) {
+  FakeModem * modem = createModem();
+  modem->maxBaud = maxBaud;
+  modem->resetPin = PIN_RESET;
+  AsyncGSM * gsm = createGsm(modem);
+  gsm->setBaudRate(target, baud, setHostBaud, modem);
+  uint32_t ms = bringUp(gsm, 1);
+  Downlink downlink = measureDownlink(modem, gsm, 10, 1024, 1, 0);
+  printf("ipr %6lu (max %6lu): %8lu baud, connected in %.3f s, downlink %.0f bytes/s\n",
+	 (unsigned long)target, (unsigned long)maxBaud, (unsigned long)gsm->getBaudRate(), ms / 1000.0, downlink.rate);
+  checkDownlink(downlink);
+  destroyGsm(gsm);
+  delete modem;
+}
+
+// An application emptying its receive buffer every 50 ms, slower than
+// the line, while the modem streams +RECEIVEs, then uplink while the
+// modem raises CTS for 300 ms of every second. The lines are either left
+// to the uart (-1) or wired to pins.
+static void benchmarkFlowControl(uint32_t seconds, uint8_t enable, int8_t rtsPin, int8_t ctsPin) {
+  FakeModem * modem = createModem();
+  modem->rtsPin = rtsPin < 0 ? 0xFF : rtsPin;
+  modem->ctsPin = ctsPin < 0 ? 0xFF : ctsPin;
+  AsyncGSM * gsm = createGsm(modem);
+  if (enable)
+    gsm->enableFlowControl(rtsPin, ctsPin);
+  bringUp(gsm, 1);
+
+  Downlink downlink = measureDownlink(modem, gsm, seconds, 1024, 1, 50);
+
+  char chunk[64];
+  memset(chunk, 'u', sizeof(chunk));
+  uint32_t startBytes = modem->uplinkBytes;
+  uint32_t written = 0;
+  uint32_t start = millis();
+  uint32_t lastHold = start - 1000;
+  while (millis() - start < seconds * 1000UL) {
+    if (millis() - lastHold >= 1000) {
+      modem->holdCts(300000);
+      lastHold = millis();
+    }
+    uint16_t space = gsm->availableForWrite(0);
+    if (space > sizeof(chunk))
+      space = sizeof(chunk);
+    if (space > 0)
+      written += gsm->writeData(chunk, space, 0);
+    step(gsm);
+  }
+  double uplink = (modem->uplinkBytes - startBytes) / ((millis() - start) / 1000.0);
+  printf("flow control %-5s   %10.0f bytes/s down (%lu bytes lost), %.0f bytes/s up (%lu sends against cts)\n",
+	 !enable ? "off" : rtsPin < 0 ? "uart" : "pins", downlink.rate,
+	 (unsigned long)(downlink.injected - downlink.received), uplink, (unsigned long)modem->ctsViolations);
+  if (enable) {
+    checkDownlink(downlink);
+    checkUplink(modem, gsm, startBytes, written);
+    check(modem->ctsViolations == 0, "cipsend while cts was high");
+  }
+  destroyGsm(gsm);
+  delete modem;
+}
+
+// An application writing a 10 byte record every 100 ms, reports bytes per
+// CIPSEND with the given coalescing settings
+static void benchmarkCoalescing(uint32_t seconds, uint16_t minBytes, uint16_t maxHold) {
+  FakeModem * modem = createModem();
+  AsyncGSM * gsm = createGsm(modem);
+  bringUp(gsm, 1);
+  gsm->setCoalescing(0, minBytes, maxHold);
+
+  char record[10];
+  memset(record, 'r', sizeof(record));
+  uint32_t startBytes = modem->uplinkBytes;
+  uint32_t startSends = modem->sends;
+  uint32_t written = 0;
+  unsigned long dropped = 0;
+  uint32_t start = millis();
+  uint32_t lastRecord = start;
+  while (millis() - start < seconds * 1000UL) {
+    if (millis() - lastRecord >= 100) {
+      uint16_t n = gsm->writeData(record, sizeof(record), 0);
+      written += n;
+      dropped += sizeof(record) - n;
+      lastRecord = millis();
+    }
+    step(gsm);
+  }
+  uint32_t bytes = modem->uplinkBytes - startBytes;
+  uint32_t sends = modem->sends - startSends;
+  printf("coalescing %4u/%4u: %10.1f bytes/cipsend (%lu cipsends, %lu bytes dropped)\n",
+	 minBytes, maxHold, sends ? (double)bytes / sends : 0.0, (unsigned long)sends, dropped);
+  checkUplink(modem, gsm, startBytes, written);
+  destroyGsm(gsm);
+  delete modem;
+}
+
+// Calls process() only when nextWakeup() asks for it or the modem has
+// sent something, like a host that sleeps in between, while a 64 byte
+// report goes out every reportInterval seconds
+static void benchmarkSleep(uint32_t seconds, uint32_t reportInterval) {
+  FakeModem * modem = createModem();
+  AsyncGSM * gsm = createGsm(modem);
+  bringUp(gsm, 1);
+
+  char report[64];
+  memset(report, 's', sizeof(report));
+  unsigned long wakeups = 0;
+  uint32_t written = 0;
+  uint32_t start = millis();
+  uint32_t lastReport = start;
+  uint32_t startBytes = modem->uplinkBytes;
+  while (millis() - start < seconds * 1000UL) {
+    if (millis() - lastReport >= reportInterval * 1000UL) {
+      written += gsm->writeData(report, sizeof(report), 0);
+      lastReport = millis();
+    }
+    uint32_t sleep = gsm->nextWakeup();
+    // sleep in 1 ms steps until the deadline or modem data
+    while (sleep > 0 && modem->available() == 0 && millis() - lastReport < reportInterval * 1000UL) {
+      hostAdvanceMicros(1000);
+      if (sleep != GSM_NO_DEADLINE)
+	sleep--;
+    }
+    step(gsm);
+    wakeups++;
+  }
+  double minutes = (millis() - start) / 60000.0;
+  printf("sleeping host:       %10.1f wake-ups/min (%lu bytes sent)\n", wakeups / minutes, (unsigned long)(modem->uplinkBytes - startBytes));
+  checkUplink(modem, gsm, startBytes, written);
+  destroyGsm(gsm);
+  delete modem;
+}
+
+static uint32_t completed;
+
+static void commandDone(void *, uint8_t result, const char *) {
+  if (result == GSM_RESULT_OK)
+    completed++;
+}
+
+static void benchmarkCommands(uint32_t seconds) {
+  FakeModem * modem = createModem();
+  AsyncGSM * gsm = createGsm(modem);
+  bringUp(gsm, 0);
+
+  completed = 0;
+  uint32_t queued = 0;
+  uint32_t start = millis();
+  while (millis() - start < seconds * 1000UL) {
+    while (gsm->queueAtCommand(F("AT+CGMR"), 5000, commandDone, NULL))
+      queued++;
+    step(gsm);
+  }
+  double elapsed = (millis() - start) / 1000.0;
+  printf("commands:            %10.1f commands/s\n", completed / elapsed);
+  start = millis();
+  while ((gsm->commandQueueSize() > 0 || completed < queued) && millis() - start < DRAIN_TIMEOUT)
+    step(gsm);
+  check(completed == queued, "queued command did not complete");
+  destroyGsm(gsm);
+  delete modem;
+}
+
+#if GSM_ENABLE_SMS
+static uint32_t messagesSent;
+static uint32_t messagesFailed;
+
+static void messageDone(void *, uint8_t status, uint8_t reference) {
+  if (status == GSM_SMS_SENT && reference > 0)
+    messagesSent++;
+  else if (status != GSM_SMS_QUEUED)
+    messagesFailed++;
+}
+
+// Sends count text messages as fast as the outbox takes them while the
+// network delivers one every second, reports the time per sent message
+static void benchmarkMessages(uint8_t count) {
+  FakeModem * modem = createModem();
+  AsyncGSM * gsm = createGsm(modem);
+  bringUp(gsm, 0);
+  // let the message settings reach the modem
+  uint32_t start = millis();
+  while (millis() - start < 10000)
+    step(gsm);
+
+  ShortMessage message;
+  memset(&message, 0, sizeof(message));
+  strcpy(message.msisdn, "+35840123456");
+  messagesSent = 0;
+  messagesFailed = 0;
+  uint8_t queued = 0;
+  uint8_t injected = 0;
+  uint8_t received = 0;
+  uint8_t matched = 0;
+  uint32_t sentAt = 0;
+  start = millis();
+  uint32_t lastInject = start - 1000;
+  while ((messagesSent + messagesFailed < count || received < count) && millis() - start < 600000UL) {
+    if (queued < count) {
+      snprintf(message.message, sizeof(message.message), "ping %u", queued);
+      if (gsm->sendMessage(message, messageDone))
+	queued++;
+    }
+    if (injected < count && millis() - lastInject >= 1000 && modem->isIdle()) {
+      char text[16];
+      snprintf(text, sizeof(text), "pong %u", injected++);
+      modem->injectMessage("+35840654321", text);
+      lastInject = millis();
+    }
+    if (gsm->messageAvailable()) {
+      ShortMessage * in = gsm->peekMessage();
+      char text[16];
+      snprintf(text, sizeof(text), "pong %u", received++);
+      if (strcmp(in->message, text) == 0 && strcmp(in->msisdn, "+35840654321") == 0)
+	matched++;
+      gsm->popMessage();
+    }
+    step(gsm);
+    if (messagesSent + messagesFailed == count && sentAt == 0)
+      sentAt = millis() - start;
+  }
+  printf("messages:            %10.3f s/message sent (%lu relay links, %u/%u received)\n",
+	 sentAt / 1000.0 / count, (unsigned long)modem->smsLinks, matched, count);
+  check(messagesSent == count && modem->smsSent == count, "message not sent");
+  check(matched == count && gsm->messageOverflowCount() == 0, "message not received");
+  destroyGsm(gsm);
+  delete modem;
+}
+#endif
+
+// Bring-up and traffic across the 49.7 day wrap of millis(), the polls
+// must keep coming after it
+static void benchmarkWrap(uint32_t seconds) {
+  // one second before the wrap
+  hostAdvanceMicros(((1ULL << 32) - 1000) * 1000 - hostMicros());
+  FakeModem * modem = createModem();
+  AsyncGSM * gsm = createGsm(modem);
+  uint32_t ms = bringUp(gsm, 1);
+  uint32_t commands = modem->commands;
+  uint32_t latest = 0;
+  uint32_t start = millis();
+  while (millis() - start < seconds * 1000UL) {
+    uint32_t wakeup = gsm->nextWakeup();
+    if (wakeup != GSM_NO_DEADLINE && wakeup > latest)
+      latest = wakeup;
+    step(gsm);
+  }
+  commands = modem->commands - commands;
+  Downlink downlink = measureDownlink(modem, gsm, 10, 1024, 1, 0);
+  printf("millis() wrap:       %10.3f s to connect, %lu polls in %lu s, downlink %.0f bytes/s\n",
+	 ms / 1000.0, (unsigned long)commands, (unsigned long)seconds, downlink.rate);
+  check(commands >= seconds * 1000UL / GSM_CSQ_INTERVAL, "polling stopped at the wrap");
+  check(latest <= 86400000UL, "deadline more than a day away");
+  checkDownlink(downlink);
+  destroyGsm(gsm);
+  delete modem;
+}
+
+int main(int argc, char ** argv) {
+  if (argc > 1)
+    baud = atol(argv[1]);
+  if (argc > 2)
+    commandLatency = atol(argv[2]);
+  if (argc > 3)
+    sendLatency = atol(argv[3]);
+
+  printf("baud %lu, command latency %lu ms, send latency %lu ms, tx buffer %u, rx buffer %u\n",
+	 (unsigned long)baud, (unsigned long)commandLatency, (unsigned long)sendLatency,
+	 GSM_TX_BUFFER_SIZE, GSM_RX_BUFFER_SIZE);
+  printf("object size:         %10u bytes (sms %u, calls %u, clock %u, stats %u)\n", (unsigned)sizeof(AsyncGSM),
+	 GSM_ENABLE_SMS, GSM_ENABLE_CALLS, GSM_ENABLE_CLOCK, GSM_ENABLE_STATS);
+
+  benchmarkBringUp();
+  benchmarkUplink(60, 0);
+  benchmarkUplink(60, 1);
+  benchmarkDownlink(60, 1024);
+  benchmarkEventReader(60, 0);
+  benchmarkEventReader(60, 1);
+#if GSM_MAX_CONNECTIONS > 1
+  benchmarkConnections(60);
+#endif
+  benchmarkCommands(60);
+  benchmarkSleep(600, 60);
+  benchmarkCoalescing(60, 0, 0);
+  benchmarkCoalescing(60, 100, 1000);
+  benchmarkTransparent(600);
+  benchmarkBaudRate(460800, 0);
+  benchmarkBaudRate(460800, 230400);
+  benchmarkBaudRate(921600, 0);
+  benchmarkFlowControl(60, 0, -1, -1);
+  benchmarkFlowControl(60, 1, -1, -1);
+  benchmarkFlowControl(60, 1, PIN_RTS, PIN_CTS);
+  benchmarkErrors(60);
+#if GSM_ENABLE_SMS
+  benchmarkMessages(5);
+#endif
+  benchmarkWrap(600);
+
+  printf("process():           %10.0f ns/call (%lu calls)\n", hostSeconds * 1e9 / processCalls, processCalls);
+  if (failures) {
+    printf("%u checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}